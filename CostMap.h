@@ -0,0 +1,119 @@
+//
+// Created by Volodymyr Karpenko on 07.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__COSTMAP_H_
+#define USI_RENDERING_COMPETITION__COSTMAP_H_
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "Image.h"
+#include "Stats.h"
+
+using namespace std;
+
+/** Costs recorded for every pixel*/
+enum CostChannel {
+  COST_NANOSECONDS, COST_NODE_VISITS, COST_PRIMITIVE_TESTS, COST_SHADOW_RAYS, COST_CHANNELS
+};
+
+const char *const cost_channel_names[COST_CHANNELS] = {"time", "nodes", "tests", "shadows"};
+
+/**
+ Per-pixel cost of the render, written as heatmaps next to the image. The counts are read from the counters of
+ Stats.h, so without RENDER_STATS only the time is recorded. Renderers working on several pixels at once spread
+ the cost of a batch evenly over its pixels: a packet over its column of pixels, a wavefront tile over the tile
+ */
+class CostMap {
+ private:
+  int width, height;
+  vector<float> values[COST_CHANNELS];
+
+  /** Color of a cost normalized to [0, 1], from black through blue, green and yellow to red*/
+  static glm::vec3 heat(float t) {
+    static const glm::vec3 stops[] = {glm::vec3(0, 0, 0), glm::vec3(0, 0, 1), glm::vec3(0, 1, 0), glm::vec3(1, 1, 0),
+                                      glm::vec3(1, 0, 0)};
+    float x = glm::clamp(t, 0.0f, 1.0f) * 4.0f;
+    int i = min((int) x, 3);
+    return glm::mix(stops[i], stops[i + 1], x - (float) i);
+  }
+
+ public:
+  /** Costs of a batch of pixels counted from the moment it started*/
+  class Scope {
+   private:
+    chrono::steady_clock::time_point start{};
+    uint64_t counts[STAT_COUNTERS] = {};
+
+   public:
+    /**
+     @param map The map the costs will be recorded in; when null nothing is counted, so that rendering without
+     a cost map does not pay for reading the clock
+     */
+    explicit Scope(const CostMap *map) {
+      if (!map)
+        return;
+      start = chrono::steady_clock::now();
+      copy(stat_counts, stat_counts + STAT_COUNTERS, counts);
+    }
+
+    /** Costs spent since the scope started, see CostChannel*/
+    void spent(float *cost) const {
+      cost[COST_NANOSECONDS] = (float) chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+      cost[COST_NODE_VISITS] = (float) (stat_counts[NODE_VISITS] - counts[NODE_VISITS]);
+      cost[COST_PRIMITIVE_TESTS] = (float) (stat_counts[PRIMITIVE_TESTS] - counts[PRIMITIVE_TESTS]);
+      cost[COST_SHADOW_RAYS] = (float) (stat_counts[SHADOW_RAYS] - counts[SHADOW_RAYS]);
+    }
+  };
+
+  CostMap(int width, int height) : width(width), height(height) {
+    for (auto &channel: values)
+      channel.assign((size_t) width * height, 0.0f);
+  }
+
+  /**
+   Records the cost of a rectangle of pixels, shared evenly by its pixels
+   @param scope Scope started before the pixels were rendered
+   @param i0, i1 Columns of the pixels, i1 excluded
+   @param j0, j1 Rows of the pixels, j1 excluded
+   */
+  void record(const Scope &scope, int i0, int i1, int j0, int j1) {
+    float cost[COST_CHANNELS];
+    scope.spent(cost);
+    float share = 1.0f / (float) ((i1 - i0) * (j1 - j0));
+    for (int c = 0; c < COST_CHANNELS; c++)
+      for (int j = j0; j < j1; j++)
+        for (int i = i0; i < i1; i++)
+          values[c][j * width + i] = cost[c] * share;
+  }
+
+  /**
+   Writes one heatmap per channel. A channel is normalized by its 99.5th percentile rather than its largest cost,
+   so that a few pixels slowed down by the scheduler do not turn the whole time map black
+   @param prefix Path of the maps without the channel name and extension
+   */
+  void write(const string &prefix) const {
+    for (int c = 0; c < COST_CHANNELS; c++) {
+      vector<float> sorted = values[c];
+      auto top = sorted.begin() + (ptrdiff_t) ((double) (sorted.size() - 1) * 0.995);
+      nth_element(sorted.begin(), top, sorted.end());
+      float scale = *top;
+      float largest = *max_element(top, sorted.end());
+      Image map(width, height);
+      for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+          map.setPixel(i, j, heat(scale > 0 ? values[c][j * width + i] / scale : 0.0f));
+      string path = prefix + "_" + cost_channel_names[c] + ".ppm";
+      map.writeImage(path.c_str());
+      cout << "Cost map " << path << ": red at " << scale << ", largest " << largest << " per pixel" << endl;
+    }
+  }
+};
+
+CostMap *cost_map = nullptr; ///< Per-pixel cost of the render, not recorded when null
+
+#endif //USI_RENDERING_COMPETITION__COSTMAP_H_
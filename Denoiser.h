@@ -0,0 +1,87 @@
+//
+// Created by Volodymyr Karpenko on 14.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__DENOISER_H_
+#define USI_RENDERING_COMPETITION__DENOISER_H_
+#include <cmath>
+#include <vector>
+#include "glm/glm.hpp"
+#include "thread-pool/thread_pool.hpp"
+#include "FrameBuffer.h"
+
+using namespace std;
+
+/** Parameters of the denoiser, a larger sigma lets more different pixels blend*/
+struct DenoiseSettings {
+  int iterations = 5; ///< Passes of the filter, pass k reaching 2^k pixels away
+  float sigma_color = 1.0f; ///< Color difference tolerated by the first pass, halved by every pass
+  float sigma_normal = 0.3f; ///< Normal difference tolerated
+  float sigma_albedo = 0.1f; ///< Albedo difference tolerated
+  float sigma_depth = 0.05f; ///< Depth difference tolerated, relative to the depth
+};
+
+/**
+ Edge-avoiding à-trous wavelet filter (Dammertz et al., 2010). Every pass blurs the colors with a 5x5 B3-spline
+ kernel whose taps are spread 2^k pixels apart, and weights every tap by how close its color, normal, albedo and
+ depth are to the ones of the center pixel, so the noise of the soft shadows and the depth of field is averaged
+ within surfaces while their edges and textures are kept. Pixels of reflecting or refracting surfaces are left as they
+ are and not blended into their neighbours, since what they show is not described by their first hits.
+ The passes run over blocks of rows on the thread pool
+ @param frame The render, whose colors are replaced by the filtered ones
+ @param settings Parameters of the filter
+ @param pool Threads running the passes
+ */
+void denoise(FrameBuffer &frame, const DenoiseSettings &settings, thread_pool &pool) {
+  static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+  int width = frame.width, height = frame.height;
+  vector<glm::vec3> input = frame.color;
+  vector<glm::vec3> &output = frame.color;
+  float sigma_color = settings.sigma_color;
+  for (int pass = 0; pass < settings.iterations; pass++) {
+    int step = 1 << pass;
+    float color_factor = 1.0f / (sigma_color * sigma_color);
+    pool.parallelize_loop(0, height, [&](int j0, int j1) {
+      for (int j = j0; j < j1; j++)
+        for (int i = 0; i < width; i++) {
+          int p = j * width + i;
+          if (frame.mirror[p]) {
+            output[p] = input[p];
+            continue;
+          }
+          glm::vec3 sum(0.0f);
+          float weights = 0.0f;
+          for (int y = -2; y <= 2; y++) {
+            int jq = j + y * step;
+            if (jq < 0 || jq >= height)
+              continue;
+            for (int x = -2; x <= 2; x++) {
+              int iq = i + x * step;
+              if (iq < 0 || iq >= width)
+                continue;
+              int q = jq * width + iq;
+              if (frame.mirror[q])
+                continue;
+              glm::vec3 dc = input[p] - input[q];
+              glm::vec3 dn = frame.normal[p] - frame.normal[q];
+              glm::vec3 da = frame.albedo[p] - frame.albedo[q];
+              float dd = abs(frame.depth[p] - frame.depth[q]) / (settings.sigma_depth * max(frame.depth[p], 1e-3f));
+              float w = kernel[x + 2] * kernel[y + 2]
+                  * exp(-glm::dot(dc, dc) * color_factor
+                            - glm::dot(dn, dn) / (settings.sigma_normal * settings.sigma_normal)
+                            - glm::dot(da, da) / (settings.sigma_albedo * settings.sigma_albedo)
+                            - dd);
+              sum += w * input[q];
+              weights += w;
+            }
+          }
+          output[p] = sum / weights;
+        }
+    });
+    sigma_color *= 0.5f;
+    if (pass + 1 < settings.iterations)
+      input = output;
+  }
+}
+
+#endif //USI_RENDERING_COMPETITION__DENOISER_H_
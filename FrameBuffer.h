@@ -0,0 +1,104 @@
+//
+// Created by Volodymyr Karpenko on 14.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__FRAMEBUFFER_H_
+#define USI_RENDERING_COMPETITION__FRAMEBUFFER_H_
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "Image.h"
+
+using namespace std;
+
+/**
+ Float image of the render with its arbitrary output variables: the features of the first hits of the camera rays of
+ every pixel, which guide the denoiser and allow compositing, and the direct and indirect light, which add up to the
+ color before tone mapping. Every pixel is written once, by the thread rendering it
+ */
+class FrameBuffer {
+ public:
+  int width, height;
+  vector<glm::vec3> color; ///< Tonemapped color of every pixel
+  vector<glm::vec3> normal; ///< Mean world normal at the first hits, zero where the camera rays miss
+  vector<glm::vec3> albedo; ///< Mean diffuse color at the first hits
+  vector<float> depth; ///< Mean distance from the camera to the first hits, zero where the camera rays miss
+  vector<char> mirror; ///< Whether a first hit reflects or refracts, its color then not following the features above
+  vector<float> object_id; ///< Index in the scene of the object hit first, -1 where the camera ray misses
+  vector<float> material_id; ///< Material of the object hit first, -1 where the camera ray misses
+  vector<glm::vec2> uv; ///< Texture coordinates at the first hit
+  vector<glm::vec3> direct; ///< Mean light of the first hits coming straight from the lights, before tone mapping
+  vector<glm::vec3> indirect; ///< Mean light of the reflected and refracted rays, before tone mapping
+
+  FrameBuffer(int width, int height)
+      : width(width), height(height), color((size_t) width * height), normal((size_t) width * height),
+        albedo((size_t) width * height), depth((size_t) width * height), mirror((size_t) width * height),
+        object_id((size_t) width * height), material_id((size_t) width * height), uv((size_t) width * height),
+        direct((size_t) width * height), indirect((size_t) width * height) {
+  }
+
+  /**
+   Writes a float image in the portable float map format, with one channel or three
+   @param path Path of the image
+   @param channels 1 or 3
+   @param value Function giving the channels of a pixel
+   */
+  template<class Value>
+  void writeFloatImage(const string &path, int channels, Value value) const {
+    ofstream file(path, ios::binary);
+    file << (channels == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";
+    vector<float> row((size_t) width * channels);
+    // the rows of a float map go from the bottom to the top, the negative scale means little-endian floats
+    for (int j = height - 1; j >= 0; j--) {
+      for (int i = 0; i < width; i++)
+        value(j * width + i, &row[(size_t) i * channels]);
+      file.write((const char *) row.data(), (streamsize) (row.size() * sizeof(float)));
+    }
+  }
+
+  /**
+   Writes every output variable as its own float image
+   @param prefix Path of the images without the name of the variable and the extension
+   */
+  void writeAovs(const string &prefix) const {
+    auto vec3 = [](const vector<glm::vec3> &channel) {
+      return [&channel](int p, float *out) {
+        out[0] = channel[p].r;
+        out[1] = channel[p].g;
+        out[2] = channel[p].b;
+      };
+    };
+    auto scalar = [](const vector<float> &channel) {
+      return [&channel](int p, float *out) {
+        out[0] = channel[p];
+      };
+    };
+    writeFloatImage(prefix + "_color.pfm", 3, vec3(color));
+    writeFloatImage(prefix + "_depth.pfm", 1, scalar(depth));
+    writeFloatImage(prefix + "_normal.pfm", 3, vec3(normal));
+    writeFloatImage(prefix + "_albedo.pfm", 3, vec3(albedo));
+    writeFloatImage(prefix + "_object.pfm", 1, scalar(object_id));
+    writeFloatImage(prefix + "_material.pfm", 1, scalar(material_id));
+    writeFloatImage(prefix + "_uv.pfm", 3, [this](int p, float *out) {
+      out[0] = uv[p].x;
+      out[1] = uv[p].y;
+      out[2] = 0.0f;
+    });
+    writeFloatImage(prefix + "_direct.pfm", 3, vec3(direct));
+    writeFloatImage(prefix + "_indirect.pfm", 3, vec3(indirect));
+    cout << "Output variables written to " << prefix << "_*.pfm" << endl;
+  }
+
+  /** Copies the colors into an image*/
+  void toImage(Image &image) const {
+    for (int j = 0; j < height; j++)
+      for (int i = 0; i < width; i++)
+        image.setPixel(i, j, glm::clamp(color[j * width + i], glm::vec3(0.0f), glm::vec3(1.0f)));
+  }
+};
+
+FrameBuffer *frame_buffer = nullptr; ///< Float image and guides of the render, only kept when they are needed
+
+#endif //USI_RENDERING_COMPETITION__FRAMEBUFFER_H_
@@ -13,6 +13,11 @@
 #ifndef Image_h
 #define Image_h
 
+#include <fstream>
+#include <limits>
+#include <string>
+#include "glm/glm.hpp"
+
 using namespace std;
 
 /**
@@ -33,6 +38,66 @@ public:
         data = new int[3*width*height];
     }
     
+    /**
+     Reads an image written by writeImage, or any other ppm file in the plain (P3) or binary (P6) format
+     @param path the path of the image
+     @return the image, nullptr when the file cannot be read
+     */
+    static Image *readImage(const char *path){
+        ifstream file(path, ios::binary);
+        string format;
+        int w = 0, h = 0, maximum = 0;
+        file >> format;
+        // skip the comments between the fields of the header
+        auto field = [&file](int &value){
+            file >> ws;
+            while(file.peek() == '#'){
+                file.ignore(numeric_limits<streamsize>::max(), '\n');
+                file >> ws;
+            }
+            file >> value;
+        };
+        field(w);
+        field(h);
+        field(maximum);
+        if(!file || (format != "P3" && format != "P6") || w <= 0 || h <= 0 || maximum <= 0 || maximum > 255)
+            return nullptr;
+        file.get();
+        Image *image = new Image(w, h);
+        for(int i = 0; i < 3*w*h; i++){
+            int value;
+            if(format == "P3")
+                file >> value;
+            else
+                value = file.get();
+            if(!file){
+                delete[] image->data;
+                delete image;
+                return nullptr;
+            }
+            image->data[i] = value * 255 / maximum;
+        }
+        return image;
+    }
+
+    int getWidth() const{
+        return width;
+    }
+
+    int getHeight() const{
+        return height;
+    }
+
+    /**
+     Value of one pixel
+     @param x x coordinate of the pixel - index of the column counting from left to right
+     @param y y coordinate of the pixel - index of the row counting from top to bottom
+     @return color of the pixel expressed as vec3 of RGB values in range from 0 to 1
+     */
+    glm::vec3 getPixel(int x, int y) const{
+        return glm::vec3(data[3 * (y*width + x)], data[3 * (y*width + x) + 1], data[3 * (y*width + x) + 2]) / 255.0f;
+    }
+
     /**
      Writes and image to a file in ppm format
      @param path the path where to the target image
@@ -0,0 +1,194 @@
+//
+// Created by Volodymyr Karpenko on 11.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__IMAGECOMPARE_H_
+#define USI_RENDERING_COMPETITION__IMAGECOMPARE_H_
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "Image.h"
+#include "Options.h"
+
+using namespace std;
+
+/** Difference of a rendered image from its reference*/
+struct ImageError {
+  double rmse; ///< Root mean square error over the channels in [0, 1]
+  double psnr; ///< Peak signal-to-noise ratio in dB, infinite for identical images
+  double flip; ///< Mean perceptual error of the pixels in [0, 1], see compare_images
+  double max_flip; ///< Largest perceptual error of a pixel
+};
+
+/** Largest differences an image may have from its reference to pass*/
+struct ImageThresholds {
+  double max_rmse = INFINITY;
+  double min_psnr = 0.0;
+  double max_flip = 0.01;
+};
+
+/** Thresholds given with --max-rmse, --min-psnr and --max-flip*/
+ImageThresholds image_thresholds(const Options &options) {
+  ImageThresholds thresholds;
+  thresholds.max_rmse = options.get("max-rmse", (float) thresholds.max_rmse);
+  thresholds.min_psnr = options.get("min-psnr", (float) thresholds.min_psnr);
+  thresholds.max_flip = options.get("max-flip", (float) thresholds.max_flip);
+  return thresholds;
+}
+
+/** Converts a display color in [0, 1] to CIELAB under D65*/
+glm::vec3 srgb_to_lab(glm::vec3 color) {
+  glm::vec3 linear;
+  for (int c = 0; c < 3; c++)
+    linear[c] = color[c] <= 0.04045f ? color[c] / 12.92f : pow((color[c] + 0.055f) / 1.055f, 2.4f);
+  // XYZ relative to the white point
+  glm::vec3 xyz(
+      (0.4124564f * linear.r + 0.3575761f * linear.g + 0.1804375f * linear.b) / 0.95047f,
+      0.2126729f * linear.r + 0.7151522f * linear.g + 0.0721750f * linear.b,
+      (0.0193339f * linear.r + 0.1191920f * linear.g + 0.9503041f * linear.b) / 1.08883f);
+  glm::vec3 f;
+  for (int c = 0; c < 3; c++)
+    f[c] = xyz[c] > 0.008856f ? cbrt(xyz[c]) : 7.787f * xyz[c] + 16.0f / 116.0f;
+  return glm::vec3(116.0f * f.y - 16.0f, 500.0f * (f.x - f.y), 200.0f * (f.y - f.z));
+}
+
+/** Color difference of FLIP: lightness and chroma are added rather than combined as a Euclidean distance*/
+float hyab(glm::vec3 a, glm::vec3 b) {
+  return abs(a.x - b.x) + glm::length(glm::vec2(a.y - b.y, a.z - b.z));
+}
+
+/** Blurs a channel with a normalized Gaussian kernel, clamping at the borders*/
+void gaussian_blur(vector<float> &channel, int width, int height, float sigma) {
+  int radius = (int) ceil(3.0f * sigma);
+  vector<float> kernel(2 * radius + 1);
+  float sum = 0.0f;
+  for (int k = -radius; k <= radius; k++)
+    sum += kernel[k + radius] = exp(-(float) (k * k) / (2.0f * sigma * sigma));
+  for (auto &weight: kernel)
+    weight /= sum;
+  vector<float> rows(channel.size());
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      float value = 0.0f;
+      for (int k = -radius; k <= radius; k++)
+        value += kernel[k + radius] * channel[y * width + glm::clamp(x + k, 0, width - 1)];
+      rows[y * width + x] = value;
+    }
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      float value = 0.0f;
+      for (int k = -radius; k <= radius; k++)
+        value += kernel[k + radius] * rows[glm::clamp(y + k, 0, height - 1) * width + x];
+      channel[y * width + x] = value;
+    }
+}
+
+/** Magnitude of the Sobel gradient of a channel in [0, 1], a step from 0 to 1 having a gradient of 1*/
+vector<float> sobel(const vector<float> &channel, int width, int height) {
+  auto at = [&](int x, int y) {
+    return channel[glm::clamp(y, 0, height - 1) * width + glm::clamp(x, 0, width - 1)];
+  };
+  vector<float> gradient(channel.size());
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      float gx = at(x + 1, y - 1) + 2.0f * at(x + 1, y) + at(x + 1, y + 1)
+          - at(x - 1, y - 1) - 2.0f * at(x - 1, y) - at(x - 1, y + 1);
+      float gy = at(x - 1, y + 1) + 2.0f * at(x, y + 1) + at(x + 1, y + 1)
+          - at(x - 1, y - 1) - 2.0f * at(x, y - 1) - at(x + 1, y - 1);
+      gradient[y * width + x] = 0.25f * sqrt(gx * gx + gy * gy);
+    }
+  return gradient;
+}
+
+/**
+ Compares two images of the same size. Besides RMSE and PSNR, computes a simplified FLIP error: the images are
+ blurred like the eye does at a normal viewing distance, compared with the HyAB distance in CIELAB normalized by the
+ distance from green to blue, and the color error is raised to the power of one minus the difference of the edges,
+ so that differences along edges count more than noise in flat regions. This follows the structure of FLIP without
+ its exact contrast sensitivity filters, so its values are close to but not equal to the reference implementation
+ @param test The rendered image
+ @param reference The image it should look like
+ @param error_map Image receiving the perceptual error of every pixel as a gray level, ignored when null
+ */
+ImageError compare_images(const Image &test, const Image &reference, Image *error_map = nullptr) {
+  int width = test.getWidth(), height = test.getHeight();
+  size_t pixels = (size_t) width * height;
+  const Image *images[2] = {&test, &reference};
+  vector<float> lab[2][3];
+  vector<float> lightness[2];
+  double squared = 0.0;
+  for (int m = 0; m < 2; m++) {
+    for (auto &channel: lab[m])
+      channel.resize(pixels);
+    lightness[m].resize(pixels);
+    for (int y = 0; y < height; y++)
+      for (int x = 0; x < width; x++) {
+        glm::vec3 color = glm::clamp(images[m]->getPixel(x, y), 0.0f, 1.0f);
+        glm::vec3 l = srgb_to_lab(color);
+        for (int c = 0; c < 3; c++)
+          lab[m][c][y * width + x] = l[c];
+        lightness[m][y * width + x] = l.x / 100.0f;
+        if (m == 1) {
+          glm::vec3 d = color - glm::clamp(test.getPixel(x, y), 0.0f, 1.0f);
+          squared += glm::dot(d, d);
+        }
+      }
+    // blurring CIELAB directly instead of the opponent space of FLIP is the main simplification
+    for (auto &channel: lab[m])
+      gaussian_blur(channel, width, height, 1.0f);
+  }
+  vector<float> edges[2] = {sobel(lightness[0], width, height), sobel(lightness[1], width, height)};
+
+  float largest = pow(hyab(srgb_to_lab(glm::vec3(0, 1, 0)), srgb_to_lab(glm::vec3(0, 0, 1))), 0.7f);
+  ImageError error{};
+  error.rmse = sqrt(squared / (3.0 * (double) pixels));
+  error.psnr = error.rmse > 0.0 ? 20.0 * log10(1.0 / error.rmse) : INFINITY;
+  double sum = 0.0;
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      size_t p = y * width + x;
+      glm::vec3 a(lab[0][0][p], lab[0][1][p], lab[0][2][p]);
+      glm::vec3 b(lab[1][0][p], lab[1][1][p], lab[1][2][p]);
+      float color = min(1.0f, pow(hyab(a, b), 0.7f) / largest);
+      float feature = min(1.0f, abs(edges[0][p] - edges[1][p]));
+      float e = pow(color, 1.0f - feature);
+      sum += e;
+      error.max_flip = max(error.max_flip, (double) e);
+      if (error_map)
+        error_map->setPixel(x, y, glm::vec3(e));
+    }
+  error.flip = sum / (double) pixels;
+  return error;
+}
+
+/**
+ Compares a rendered image with its reference, prints the errors and writes the error map given with --error-map
+ @param test The rendered image
+ @param reference The image it should look like
+ @param options Thresholds of the comparison, see image_thresholds, and --error-map
+ @return Whether the image is within the thresholds
+ */
+bool check_image(const Image &test, const Image &reference, const Options &options) {
+  if (test.getWidth() != reference.getWidth() || test.getHeight() != reference.getHeight()) {
+    cout << "Image size " << test.getWidth() << "x" << test.getHeight() << " differs from the reference size "
+         << reference.getWidth() << "x" << reference.getHeight() << endl;
+    return false;
+  }
+  Image *error_map = options.has("error-map") ? new Image(test.getWidth(), test.getHeight()) : nullptr;
+  ImageError error = compare_images(test, reference, error_map);
+  ImageThresholds thresholds = image_thresholds(options);
+  bool passed = error.rmse <= thresholds.max_rmse && error.psnr >= thresholds.min_psnr
+      && error.flip <= thresholds.max_flip;
+  cout << "RMSE " << error.rmse << ", PSNR " << error.psnr << " dB, FLIP " << error.flip << " (largest "
+       << error.max_flip << "): " << (passed ? "passed" : "FAILED") << endl;
+  if (error_map) {
+    error_map->writeImage(options.get("error-map", "./error.ppm").c_str());
+    delete error_map;
+  }
+  return passed;
+}
+
+#endif //USI_RENDERING_COMPETITION__IMAGECOMPARE_H_
@@ -5,6 +5,9 @@
 #ifndef USI_RENDERING_COMPETITION__LIGHT_H_
 #define USI_RENDERING_COMPETITION__LIGHT_H_
 
+#include <cmath>
+#include <random>
+#include <vector>
 #include "glm/glm.hpp"
 #include "glm/gtx/transform.hpp"
 
@@ -33,37 +36,163 @@ glm::vec3 toneMapping(glm::vec3 intensity) {
 
 vector<Light *> lights; ///< A list of lights in the scene
 glm::vec3 ambient_light(0.001, 0.001, 0.001);
-vector<vector<Light *>> soft_lights;
-
-vector<Light *> build_light(float r, Light *light_g, int steps) {
-  float tmpX, tmpY, lastX, lastY;
-  lastX = lastY = 0;
-  vector<Light *> local_light;
-  for (int angle = steps; angle < 90; angle += steps)//Bigger circle, Smaller angle step
-  {
-    tmpX = r * cos((float) angle * M_PI);
-    tmpY = r * sin((float) angle * M_PI);
-    if (tmpX == lastX && tmpY == lastY) {
-      continue;
+
+/**
+ Light samples as a structure of arrays, so that the shading loops over the samples vectorize.
+ The samples of one area light form a group, whose contributions are averaged.
+ */
+struct LightArrays {
+  vector<float> x, y, z; ///< Positions of the samples
+  vector<float> r, g, b; ///< Colors of the samples
+  vector<int> group_end; ///< One past the last sample of every group
+  vector<int> group_light; ///< Index in area_lights of the light of every group
+
+  int size() const {
+    return (int) x.size();
+  }
+
+  void clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    r.clear();
+    g.clear();
+    b.clear();
+    group_end.clear();
+    group_light.clear();
+  }
+
+  void push_back(glm::vec3 position, glm::vec3 color) {
+    x.push_back(position.x);
+    y.push_back(position.y);
+    z.push_back(position.z);
+    r.push_back(color.r);
+    g.push_back(color.g);
+    b.push_back(color.b);
+  }
+};
+
+/**
+ Shape of an area light
+ */
+enum class AreaShape {
+  Disk, ///< Disk spanned by the two axes, which have the length of the radius
+  Rect, ///< Rectangle spanned by the two axes, which go from the center to the middle of the sides
+  Sphere ///< Sphere whose radius is the length of the first axis
+};
+
+/**
+ Area lights stored contiguously as a structure of arrays. Their samples are drawn at shading time.
+ */
+struct AreaLights {
+  vector<AreaShape> shape;
+  vector<glm::vec3> center;
+  vector<glm::vec3> u; ///< First axis of the shape
+  vector<glm::vec3> v; ///< Second axis of the shape
+  vector<glm::vec3> color;
+
+  int size() const {
+    return (int) shape.size();
+  }
+
+  void add(AreaShape light_shape, glm::vec3 light_center, glm::vec3 axis_u, glm::vec3 axis_v, glm::vec3 light_color) {
+    shape.push_back(light_shape);
+    center.push_back(light_center);
+    u.push_back(axis_u);
+    v.push_back(axis_v);
+    color.push_back(light_color);
+  }
+
+  /**
+   @param light_center Center of the disk
+   @param normal Normal of the disk
+   @param radius Radius of the disk
+   @param light_color Color/intensity of the light
+   */
+  void add_disk(glm::vec3 light_center, glm::vec3 normal, float radius, glm::vec3 light_color) {
+    normal = glm::normalize(normal);
+    glm::vec3 helper = fabs(normal.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+    glm::vec3 axis_u = glm::normalize(glm::cross(normal, helper));
+    glm::vec3 axis_v = glm::cross(normal, axis_u);
+    add(AreaShape::Disk, light_center, radius * axis_u, radius * axis_v, light_color);
+  }
+
+  /**
+   @param light_center Center of the rectangle
+   @param half_u Vector from the center to the middle of one side
+   @param half_v Vector from the center to the middle of an adjacent side
+   @param light_color Color/intensity of the light
+   */
+  void add_rect(glm::vec3 light_center, glm::vec3 half_u, glm::vec3 half_v, glm::vec3 light_color) {
+    add(AreaShape::Rect, light_center, half_u, half_v, light_color);
+  }
+
+  /**
+   @param light_center Center of the sphere
+   @param radius Radius of the sphere
+   @param light_color Color/intensity of the light
+   */
+  void add_sphere(glm::vec3 light_center, float radius, glm::vec3 light_color) {
+    add(AreaShape::Sphere, light_center, glm::vec3(radius, 0, 0), glm::vec3(0), light_color);
+  }
+
+  /**
+   Point of a light for a pair of uniform numbers in [0, 1)
+   @param i Index of the light
+   @param s, t The uniform numbers
+   */
+  glm::vec3 point(int i, float s, float t) const {
+    switch (shape[i]) {
+      case AreaShape::Rect: return center[i] + (2 * s - 1) * u[i] + (2 * t - 1) * v[i];
+      case AreaShape::Disk: {
+        // concentric mapping of the square onto the disk
+        float a = 2 * s - 1;
+        float b = 2 * t - 1;
+        if (a == 0 && b == 0)
+          return center[i];
+        float r, phi;
+        if (fabs(a) > fabs(b)) {
+          r = a;
+          phi = (float) (M_PI / 4) * (b / a);
+        } else {
+          r = b;
+          phi = (float) (M_PI / 2) - (float) (M_PI / 4) * (a / b);
+        }
+        return center[i] + r * cos(phi) * u[i] + r * sin(phi) * v[i];
+      }
+      default: {
+        float z = 1 - 2 * s;
+        float ring = sqrt(max(0.0f, 1 - z * z));
+        float phi = 2 * (float) M_PI * t;
+        return center[i] + glm::length(u[i]) * glm::vec3(ring * cos(phi), ring * sin(phi), z);
+      }
+    }
+  }
+};
+
+AreaLights area_lights; ///< Area lights of the scene
+int light_samples = 16; ///< Samples drawn from every area light at every shading point
+thread_local minstd_rand light_rng(random_device{}()); ///< Random numbers of the light samples, one stream per thread
+
+/**
+ Draws stratified samples of every area light: the unit square is cut into a grid of about light_samples cells
+ and one jittered point is taken in each of the first light_samples cells
+ @param samples The samples, one group per area light
+ */
+void sample_area_lights(LightArrays &samples) {
+  samples.clear();
+  int columns = (int) ceil(sqrt((float) light_samples));
+  int rows = (light_samples + columns - 1) / columns;
+  uniform_real_distribution<float> jitter(0.0f, 1.0f);
+  for (int i = 0; i < area_lights.size(); i++) {
+    for (int k = 0; k < light_samples; k++) {
+      float s = ((float) (k % columns) + jitter(light_rng)) / (float) columns;
+      float t = ((float) (k / columns) + jitter(light_rng)) / (float) rows;
+      samples.push_back(area_lights.point(i, min(s, 0.99999994f), min(t, 0.99999994f)), area_lights.color[i]);
     }
-    auto *l1 = new Light(light_g->position, light_g->color);
-    l1->position.x += tmpX;
-    l1->position.x += tmpY;
-    local_light.push_back(l1);
-    l1 = new Light(light_g->position, light_g->color);
-    l1->position.x -= tmpX;
-    l1->position.x += tmpY;
-    local_light.push_back(l1);
-    l1 = new Light(light_g->position, light_g->color);
-    l1->position.x += tmpX;
-    l1->position.x -= tmpY;
-    local_light.push_back(l1);
-    l1 = new Light(light_g->position, light_g->color);
-    l1->position.x -= tmpX;
-    l1->position.x -= tmpY;
-    local_light.push_back(l1);
+    samples.group_end.push_back(samples.size());
+    samples.group_light.push_back(i);
   }
-  return local_light;
 }
 
 void position_lights() {
@@ -76,14 +205,14 @@ void position_lights() {
   auto light_g = new Light(glm::vec3(0, 5, 0), glm::vec3(0.3));
   float x = light_g->position.x;
   for (int i = 0; i < 1; i++) {
-    light_g->position.x = x+(float)(i+1)/10.f;
-    soft_lights.push_back(build_light(0.05f, light_g, 18));
-    light_g->position.x = x-(float)(i-1)/10.f;
-    soft_lights.push_back(build_light(0.05f, light_g, 18));
+    area_lights.add_disk(glm::vec3(x + (float) (i + 1) / 10.f, light_g->position.y, light_g->position.z),
+                         glm::vec3(0, 0, 1), 0.05f, light_g->color);
+    area_lights.add_disk(glm::vec3(x - (float) (i - 1) / 10.f, light_g->position.y, light_g->position.z),
+                         glm::vec3(0, 0, 1), 0.05f, light_g->color);
   }
 //  light_g->color = glm::vec3(1.f);
-//  soft_lights.push_back(build_light(2.f,light_g, 8));
-//  soft_lights.push_back(build_light(3.f,light_g, 10));
+//  area_lights.add_disk(light_g->position, glm::vec3(0, -1, 0), 2.f, light_g->color);
+//  area_lights.add_sphere(light_g->position, 3.f, light_g->color);
 }
 
 #endif //USI_RENDERING_COMPETITION__LIGHT_H_
@@ -0,0 +1,159 @@
+//
+// Created by Volodymyr Karpenko on 03.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__LIGHTTREE_H_
+#define USI_RENDERING_COMPETITION__LIGHTTREE_H_
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "glm/glm.hpp"
+#include "Light.h"
+
+using namespace std;
+
+/**
+ Bounding volume hierarchy over the area lights, used to pick lights with a probability proportional to an estimate
+ of their contribution. A pick walks down from the root and chooses a child with the probability of its importance,
+ the intensity of the lights below a node divided by the squared distance to its bounds, so the cost of a pick only
+ grows with the depth of the tree and not with the number of lights.
+ */
+class LightTree {
+ private:
+  struct Node {
+    glm::vec3 min, max; ///< Bounds of the lights below the node
+    float intensity; ///< Summed intensity of the lights below the node
+    int right; ///< Index of the second child, the first child follows the node; -1 for a leaf
+    int light; ///< Index of the light in area_lights for a leaf
+  };
+
+  vector<Node> nodes;
+
+  /** Half extent of the bounding box of one area light*/
+  static glm::vec3 light_extent(const AreaLights &lights, int i) {
+    glm::vec3 u = lights.u[i], v = lights.v[i];
+    switch (lights.shape[i]) {
+      case AreaShape::Rect: return glm::abs(u) + glm::abs(v);
+      case AreaShape::Disk: return glm::sqrt(u * u + v * v);
+      default: return glm::vec3(glm::length(u));
+    }
+  }
+
+  int build(const AreaLights &lights, vector<int> &order, int first, int last) {
+    int index = (int) nodes.size();
+    nodes.push_back({glm::vec3(INFINITY), glm::vec3(-INFINITY), 0.0f, -1, -1});
+    glm::vec3 centroid_min(INFINITY), centroid_max(-INFINITY);
+    for (int k = first; k < last; k++) {
+      int i = order[k];
+      glm::vec3 extent = light_extent(lights, i);
+      nodes[index].min = glm::min(nodes[index].min, lights.center[i] - extent);
+      nodes[index].max = glm::max(nodes[index].max, lights.center[i] + extent);
+      nodes[index].intensity += (lights.color[i].r + lights.color[i].g + lights.color[i].b) / 3.0f;
+      centroid_min = glm::min(centroid_min, lights.center[i]);
+      centroid_max = glm::max(centroid_max, lights.center[i]);
+    }
+    if (last - first == 1) {
+      nodes[index].light = order[first];
+      return index;
+    }
+
+    // median split along the longest axis of the centers
+    glm::vec3 size = centroid_max - centroid_min;
+    int axis = size.x > size.y && size.x > size.z ? 0 : (size.y > size.z ? 1 : 2);
+    int middle = (first + last) / 2;
+    nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+      return lights.center[a][axis] < lights.center[b][axis];
+    });
+    build(lights, order, first, middle);
+    int right = build(lights, order, middle, last);
+    nodes[index].right = right;
+    return index;
+  }
+
+  /** Estimated contribution of the lights below a node to a point*/
+  float importance(const Node &node, glm::vec3 point) const {
+    glm::vec3 center = 0.5f * (node.min + node.max);
+    glm::vec3 half = 0.5f * (node.max - node.min);
+    glm::vec3 offset = center - point;
+    // the squared radius of the bounds keeps points close to or inside a cluster from favouring it without limit
+    float distance2 = max(glm::dot(offset, offset), glm::dot(half, half));
+    return node.intensity / max(distance2, 0.01f);
+  }
+
+ public:
+  /**
+   @param lights The area lights, the tree stores indices into them
+   */
+  explicit LightTree(const AreaLights &lights) {
+    if (lights.size() == 0)
+      return;
+    vector<int> order(lights.size());
+    iota(order.begin(), order.end(), 0);
+    nodes.reserve(2 * lights.size());
+    build(lights, order, 0, lights.size());
+  }
+
+  /**
+   Picks one light with a probability roughly proportional to its contribution to a point
+   @param point The shading point
+   @param rng Random numbers of the pick
+   @param probability Probability of picking the returned light
+   @return Index of the light in area_lights, -1 when there are no lights
+   */
+  template<class Generator>
+  int pick(glm::vec3 point, Generator &rng, float &probability) const {
+    probability = 1.0f;
+    if (nodes.empty())
+      return -1;
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    int index = 0;
+    while (nodes[index].right != -1) {
+      float first = importance(nodes[index + 1], point);
+      float second = importance(nodes[nodes[index].right], point);
+      // both subtrees may have no importance, with dark lights or when the importance underflows far from them
+      float p = first + second > 0.0f ? first / (first + second) : 0.5f;
+      if (uniform(rng) < p) {
+        probability *= p;
+        index = index + 1;
+      } else {
+        probability *= 1.0f - p;
+        index = nodes[index].right;
+      }
+    }
+    return nodes[index].light;
+  }
+};
+
+LightTree *light_tree = nullptr; ///< Tree over area_lights, every light is sampled when null
+int light_picks = 4; ///< Lights picked from light_tree at every shading point, one sample each
+
+/**
+ Draws the light samples of a shading point. Without light_tree every area light gets light_samples stratified
+ samples; with it, light_picks lights are picked through the tree and each pick becomes a group of one sample whose
+ color is divided by the probability of the pick and the number of picks, so the sum over the groups stays an
+ unbiased estimate of the sum over all lights.
+ @param samples The samples of the point
+ @param point The shading point
+ */
+void sample_lights(LightArrays &samples, glm::vec3 point) {
+  if (!light_tree) {
+    sample_area_lights(samples);
+    return;
+  }
+  samples.clear();
+  uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  for (int k = 0; k < light_picks; k++) {
+    float probability;
+    int i = light_tree->pick(point, light_rng, probability);
+    if (i < 0)
+      return;
+    float s = min(uniform(light_rng), 0.99999994f);
+    float t = min(uniform(light_rng), 0.99999994f);
+    samples.push_back(area_lights.point(i, s, t), area_lights.color[i] / (probability * (float) light_picks));
+    samples.group_end.push_back(samples.size());
+    samples.group_light.push_back(i);
+  }
+}
+
+#endif //USI_RENDERING_COMPETITION__LIGHTTREE_H_
@@ -8,13 +8,15 @@
 #ifndef Material_h
 #define Material_h
 
+#include <cstdint>
+#include <vector>
 #include "glm/glm.hpp"
 #include "Textures.h"
 
 /**
- Structure describing a material of an object
+ Structure describing a material of an object, padded to one cache line
  */
-struct Material {
+struct alignas(64) Material {
   glm::vec3 ambient = glm::vec3(0.0);
   glm::vec3 diffuse = glm::vec3(1.0);
   glm::vec3 specular = glm::vec3(0.0);
@@ -25,35 +27,79 @@ struct Material {
   float refractiveIndex = 1.f;
 };
 
-Material yellow_specular{
+typedef uint16_t MaterialId; ///< Index of a material in the material table
+
+/**
+ Shading features of a material, each combination of the first three selects its own compiled shading kernel
+ */
+enum MaterialFeature : unsigned {
+  TEXTURED = 1, ///< The diffuse color is read from a texture
+  TEXTURE_SHADING = 2, ///< The texture also replaces N.L, as perlinNoise does
+  SPECULAR = 4, ///< The specular color is not black
+  REFLECTIVE = 8, ///< Reflected rays are traced
+  REFRACTIVE = 16, ///< Refracted rays are traced
+  SHADING_FEATURES = TEXTURED | TEXTURE_SHADING | SPECULAR ///< Features changing the direct light computation
+};
+
+/** Finds the shading features used by a material*/
+unsigned material_features(const Material &material) {
+  unsigned features = 0;
+  if (material.texture) features |= TEXTURED;
+  if (material.texture == perlinNoise) features |= TEXTURE_SHADING;
+  if (material.specular != glm::vec3(0.0)) features |= SPECULAR;
+  if (material.reflectivity != 0.f) features |= REFLECTIVE;
+  if (material.refract) features |= REFRACTIVE;
+  return features;
+}
+
+/**
+ Material table: objects refer to their material by index instead of holding a copy.
+ The first entry is the default material. Materials are added while setting up the scene only,
+ references into the table stay valid during rendering.
+ */
+std::vector<Material> materials(1);
+std::vector<unsigned> material_flags(1, 0); ///< Shading features of every material of the table
+
+/**
+ Adds a material to the material table
+ @param material The material
+ @return Index of the material in the table
+ */
+MaterialId add_material(const Material &material) {
+  materials.push_back(material);
+  material_flags.push_back(material_features(material));
+  return (MaterialId) (materials.size() - 1);
+}
+
+const MaterialId yellow_specular = add_material({
     glm::vec3(0.1f, 0.10f, 0.0f),
     glm::vec3(0.4f, 0.4f, 0.0f),
     glm::vec3(1.0),
     100.0
-};
+});
 
-Material green_diffuse{
+const MaterialId green_diffuse = add_material({
     glm::vec3(0.03f, 0.1f, 0.03f),
     glm::vec3(0.3f, 1.0f, 0.3f)
-};
+});
 
-Material red_specular{
+const MaterialId red_specular = add_material({
     glm::vec3(0.01f, 0.02f, 0.02f),
     glm::vec3(1.0f, 0.2f, 0.2f),
     glm::vec3(0.5),
     10.0
-};
+});
 
-Material blue_specular{
+const MaterialId blue_specular = add_material({
     glm::vec3(0.02f, 0.02f, 0.1f),
     glm::vec3(0.1f, 0.1f, 0.1f),
     glm::vec3(0.1),
     100.0,
     nullptr,
     0.5f
-};
+});
 
-Material refractive{
+const MaterialId refractive = add_material({
     glm::vec3(0.02f, 0.02f, 0.1f),
     glm::vec3(0.1f, 0.1f, 0.1f),
     glm::vec3(0.1),
@@ -62,9 +108,9 @@ Material refractive{
     0.25f,
     true,
     2.0f
-};
+});
 
-Material refractive_light{
+const MaterialId refractive_light = add_material({
     glm::vec3(0.02f, 0.02f, 0.1f),
     glm::vec3(0.1f, 0.1f, 0.1f),
     glm::vec3(0.1),
@@ -73,37 +119,37 @@ Material refractive_light{
     0.5f,
     true,
     5.0f
-};
+});
 
-Material perlinTexture{
+const MaterialId perlinTexture = add_material({
     glm::vec3(0.0),
     glm::vec3(0.0),
     glm::vec3(0.0),
     0.0f,
     &perlinNoise
-};
+});
 
-Material textured{
+const MaterialId textured = add_material({
     glm::vec3(0.0),
     glm::vec3(0.0),
     glm::vec3(0.0),
     0.0f,
     &rainbowTexture
-};
+});
 
-Material red_diffuse{
+const MaterialId red_diffuse = add_material({
     glm::vec3(0.09f, 0.06f, 0.06f),
     glm::vec3(0.9f, 0.6f, 0.6f)
-};
+});
 
-Material blue_diffuse{
+const MaterialId blue_diffuse = add_material({
     glm::vec3(0.06f, 0.06f, 0.09f),
     glm::vec3(0.6f, 0.6f, 0.9f)
-};
+});
 
-Material white_diffuse{
+const MaterialId white_diffuse = add_material({
     glm::vec3(1.0f, 1.0f, 1.0f),
     glm::vec3(0.1f, 0.1f, 0.1f)
-};
+});
 
 #endif /* Material_h */
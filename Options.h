@@ -0,0 +1,55 @@
+//
+// Created by Volodymyr Karpenko on 16.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION__OPTIONS_H_
+#define USI_RENDERING_COMPETITION__OPTIONS_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ Command line of the renderer: arguments written as --name or --name=value are options,
+ everything else is kept in order as a positional argument
+ */
+struct Options {
+  vector<string> positional; ///< Arguments that are not options, without the program name
+  map<string, string> values; ///< Value of every option, empty for options given without one
+
+  bool has(const string &name) const {
+    return values.count(name) > 0;
+  }
+  string get(const string &name, const string &fallback) const {
+    auto it = values.find(name);
+    return it == values.end() || it->second.empty() ? fallback : it->second;
+  }
+  int get(const string &name, int fallback) const {
+    return has(name) ? stoi(get(name, to_string(fallback))) : fallback;
+  }
+  float get(const string &name, float fallback) const {
+    return has(name) ? stof(get(name, to_string(fallback))) : fallback;
+  }
+};
+
+Options parse_options(int argc, const char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.rfind("--", 0) == 0) {
+      size_t eq = arg.find('=');
+      if (eq == string::npos) {
+        options.values[arg.substr(2)] = "";
+      } else {
+        options.values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+      }
+    } else {
+      options.positional.push_back(arg);
+    }
+  }
+  return options;
+}
+
+#endif //USI_RENDERING_COMPETITION__OPTIONS_H_
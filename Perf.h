@@ -0,0 +1,271 @@
+//
+// Created by Volodymyr Karpenko on 13.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__PERF_H_
+#define USI_RENDERING_COMPETITION__PERF_H_
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "Stats.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/** Hardware events counted by the profiling layer*/
+enum PerfCounter {
+  PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_COUNTERS
+};
+
+const char *const perf_counter_names[PERF_COUNTERS] = {"cycles", "instructions", "L1D misses", "LLC misses",
+                                                       "branch misses"};
+
+bool perf_enabled = false; ///< Whether the phases and tiles are measured with hardware counters
+atomic<uint64_t> perf_totals[STAT_PHASES][PERF_COUNTERS]; ///< Counts of every phase summed over the threads
+atomic<bool> perf_missing[PERF_COUNTERS]; ///< Counters the kernel refused to open on some thread
+
+/** Hardware events spent rendering one tile of the image*/
+struct PerfTile {
+  int i0, i1; ///< Columns of the tile, i1 excluded
+  int j0, j1; ///< Rows of the tile, j1 excluded
+  uint64_t rays; ///< Rays traced for the tile, 0 when the statistics of Stats.h are compiled out
+  uint64_t counts[PERF_COUNTERS];
+};
+
+mutex perf_tiles_mutex;
+vector<PerfTile> perf_tiles; ///< Events of every tile rendered, in the order the tiles finished
+
+/** Rays traced by the calling thread since its statistics were last flushed*/
+uint64_t thread_rays() {
+  return stat_counts[CAMERA_RAYS] + stat_counts[SHADOW_RAYS] + stat_counts[REFLECTION_RAYS]
+      + stat_counts[REFRACTION_RAYS];
+}
+
+/**
+ Hardware counters of one thread, opened with perf_event_open the first time the thread is measured. They count
+ user-space events of the thread only, so the counts of a worker are not mixed with the other threads. Counters
+ the kernel or the CPU does not support read as 0 and are reported as missing
+ */
+class PerfGroup {
+ private:
+  int fds[PERF_COUNTERS];
+  int slots[PERF_COUNTERS]; ///< Position of every counter in a read of the group, -1 when it is not open
+  int leader = -1;
+  int open_count = 0;
+
+#ifdef __linux__
+  static int open_counter(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+  }
+#endif
+
+ public:
+  PerfGroup() {
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      fds[c] = -1;
+      slots[c] = -1;
+    }
+#ifdef __linux__
+    const uint32_t types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                           PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      fds[c] = open_counter(types[c], configs[c], leader);
+      if (fds[c] < 0) {
+        perf_missing[c] = true;
+        continue;
+      }
+      if (leader == -1)
+        leader = fds[c];
+      slots[c] = open_count++;
+    }
+    if (leader != -1) {
+      ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    for (auto &missing: perf_missing)
+      missing = true;
+#endif
+  }
+
+  ~PerfGroup() {
+#ifdef __linux__
+    for (int fd: fds)
+      if (fd >= 0)
+        close(fd);
+#endif
+  }
+
+  /** Reads the running counts of the thread, 0 for the counters that are not open*/
+  void read(uint64_t *counts) const {
+    for (int c = 0; c < PERF_COUNTERS; c++)
+      counts[c] = 0;
+#ifdef __linux__
+    if (leader == -1)
+      return;
+    uint64_t values[1 + PERF_COUNTERS];
+    if (::read(leader, values, sizeof(values)) < (ssize_t) sizeof(uint64_t))
+      return;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+      if (slots[c] >= 0 && slots[c] < (int) values[0])
+        counts[c] = values[1 + slots[c]];
+#endif
+  }
+};
+
+/** Counters of the calling thread, opened on first use*/
+PerfGroup &perf_group() {
+  thread_local PerfGroup group;
+  return group;
+}
+
+/**
+ Adds the hardware events of the calling thread from its construction until it is stopped or destroyed to a phase,
+ and to a tile of the image when it is stopped with stop_tile
+ */
+class PerfScope {
+ private:
+  StatPhase phase;
+  uint64_t start[PERF_COUNTERS];
+  uint64_t start_rays = 0;
+  bool running;
+
+  void stop(uint64_t *counts) {
+    running = false;
+    uint64_t end[PERF_COUNTERS];
+    perf_group().read(end);
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      counts[c] = end[c] - start[c];
+      perf_totals[phase][c] += counts[c];
+    }
+  }
+
+ public:
+  explicit PerfScope(StatPhase phase) : phase(phase), running(perf_enabled) {
+    if (running) {
+      start_rays = thread_rays();
+      perf_group().read(start);
+    }
+  }
+
+  void stop() {
+    if (!running)
+      return;
+    uint64_t counts[PERF_COUNTERS];
+    stop(counts);
+  }
+
+  /** Stops the scope and records its events as the ones of the tile of columns i0 to i1 and rows j0 to j1*/
+  void stop_tile(int i0, int i1, int j0, int j1) {
+    if (!running)
+      return;
+    PerfTile tile{i0, i1, j0, j1, 0, {}};
+    stop(tile.counts);
+    tile.rays = thread_rays() - start_rays;
+    lock_guard<mutex> lock(perf_tiles_mutex);
+    perf_tiles.push_back(tile);
+  }
+
+  ~PerfScope() {
+    stop();
+  }
+};
+
+/** Writes the hardware events of every tile as CSV, one line per tile*/
+void write_perf_tiles(ostream &out) {
+  out << "i0,i1,j0,j1,rays";
+  for (auto name: perf_counter_names)
+    out << "," << name;
+  out << endl;
+  for (auto &tile: perf_tiles) {
+    out << tile.i0 << "," << tile.i1 << "," << tile.j0 << "," << tile.j1 << "," << tile.rays;
+    for (auto count: tile.counts)
+      out << "," << count;
+    out << endl;
+  }
+}
+
+/**
+ Writes the hardware events of every phase with the instructions per cycle and, for the render phase, the events
+ per ray traced when the statistics of Stats.h are compiled in. The tiles spending the most cycles follow
+ @param tiles Number of tiles listed
+ */
+void print_perf(ostream &out, int tiles = 5) {
+  out << "Hardware counters" << endl;
+  out << "  " << left << setw(10) << "phase" << right;
+  for (auto name: perf_counter_names)
+    out << setw(16) << name;
+  out << setw(8) << "IPC" << endl;
+  for (int p = 0; p < STAT_PHASES; p++) {
+    out << "  " << left << setw(10) << stat_phase_names[p] << right;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+      out << setw(16) << perf_totals[p][c];
+    double cycles = (double) perf_totals[p][PERF_CYCLES];
+    out << setw(8) << fixed << setprecision(2) << (cycles > 0 ? (double) perf_totals[p][PERF_INSTRUCTIONS] / cycles : 0.0)
+        << endl;
+    out.unsetf(ios::fixed);
+  }
+#if RENDER_STATS
+  double rays = (double) (render_stats.total(CAMERA_RAYS) + render_stats.total(SHADOW_RAYS)
+      + render_stats.total(REFLECTION_RAYS) + render_stats.total(REFRACTION_RAYS));
+  if (rays > 0) {
+    out << "  " << left << setw(10) << "per ray" << right << fixed << setprecision(3);
+    for (int c = 0; c < PERF_COUNTERS; c++)
+      out << setw(16) << (double) perf_totals[RENDER_PHASE][c] / rays;
+    out << endl;
+    out.unsetf(ios::fixed);
+  }
+#endif
+  vector<PerfTile> slowest = perf_tiles;
+  tiles = min(tiles, (int) slowest.size());
+  partial_sort(slowest.begin(), slowest.begin() + tiles, slowest.end(), [](const PerfTile &a, const PerfTile &b) {
+    return a.counts[PERF_CYCLES] > b.counts[PERF_CYCLES];
+  });
+  if (tiles > 0)
+    out << "  Tiles spending the most cycles, of " << perf_tiles.size() << endl;
+  for (int t = 0; t < tiles; t++) {
+    const PerfTile &tile = slowest[t];
+    string name = to_string(tile.i0) + "," + to_string(tile.j0);
+    out << "  " << left << setw(10) << name << right;
+    for (auto count: tile.counts)
+      out << setw(16) << count;
+    double cycles = (double) tile.counts[PERF_CYCLES];
+    out << setw(8) << fixed << setprecision(2) << (cycles > 0 ? (double) tile.counts[PERF_INSTRUCTIONS] / cycles : 0.0);
+    if (tile.rays > 0)
+      out << "  " << setprecision(1) << (double) tile.counts[PERF_L1D_MISSES] / (double) tile.rays
+          << " L1D misses per ray";
+    out << endl;
+    out.unsetf(ios::fixed);
+  }
+  for (int c = 0; c < PERF_COUNTERS; c++)
+    if (perf_missing[c])
+      out << "  " << perf_counter_names[c]
+          << " could not be opened: no such event on this CPU, or perf_event_paranoid is too high" << endl;
+}
+
+#endif //USI_RENDERING_COMPETITION__PERF_H_
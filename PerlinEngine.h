@@ -0,0 +1,339 @@
+//
+// Created by Volodymyr Karpenko on 20.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION__PERLINENGINE_H_
+#define USI_RENDERING_COMPETITION__PERLINENGINE_H_
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/**
+ Permutation of 0..SIZE - 1 repeated twice, so that the hashes of the cube corners never need wrapping
+ */
+struct PermutationTable {
+  static constexpr int SIZE = 2048;
+  int32_t p[2 * SIZE];
+};
+
+/**
+ Shuffles 0..SIZE - 1 the way PerlinNoise does, so that PerlinNoise(seed, 2 * SIZE) and the engine draw the same
+ pattern
+ @param seed Seed of the shuffle
+ */
+PermutationTable make_permutation(uint64_t seed) {
+  std::vector<int> permutation(PermutationTable::SIZE);
+  std::iota(permutation.begin(), permutation.end(), 0);
+  std::default_random_engine engine(seed);
+  std::shuffle(permutation.begin(), permutation.end(), engine);
+  PermutationTable table{};
+  for (int i = 0; i < PermutationTable::SIZE; i++)
+    table.p[i] = table.p[PermutationTable::SIZE + i] = permutation[i];
+  return table;
+}
+
+/**
+ Float precision Perlin noise, evaluating 4 points per call with SSE2 and 8 with AVX2, with a scalar version giving
+ the same values. Like PerlinNoise, the noise is remapped to [0, 1].
+ The fbm functions sum several octaves in one pass over the points.
+ */
+class PerlinEngine {
+ public:
+  static inline const PermutationTable table = make_permutation(120412); ///< Table of PerlinNoise(120412, 4096)
+  static constexpr int MASK = PermutationTable::SIZE - 1; ///< Wraps the lattice coordinates into the table
+  static constexpr int LANES = 4;
+#ifdef __AVX2__
+  static constexpr int WIDE_LANES = 8;
+#endif
+
+  /** Noise at one point*/
+  static float noise(float x, float y, float z) {
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    float fz = std::floor(z);
+    int X = (int) fx & MASK;
+    int Y = (int) fy & MASK;
+    int Z = (int) fz & MASK;
+    x -= fx;
+    y -= fy;
+    z -= fz;
+    float u = fade(x);
+    float v = fade(y);
+    float w = fade(z);
+
+    const int32_t *p = table.p;
+    int A = p[X] + Y;
+    int AA = p[A] + Z;
+    int AB = p[A + 1] + Z;
+    int B = p[X + 1] + Y;
+    int BA = p[B] + Z;
+    int BB = p[B + 1] + Z;
+
+    float res = lerp(w, lerp(v, lerp(u, grad(p[AA], x, y, z), grad(p[BA], x - 1, y, z)),
+                             lerp(u, grad(p[AB], x, y - 1, z), grad(p[BB], x - 1, y - 1, z))),
+                     lerp(v, lerp(u, grad(p[AA + 1], x, y, z - 1), grad(p[BA + 1], x - 1, y, z - 1)),
+                          lerp(u, grad(p[AB + 1], x, y - 1, z - 1), grad(p[BB + 1], x - 1, y - 1, z - 1))));
+    return (res + 1.0f) / 2.0f;
+  }
+
+  /**
+   Fractal sum of octaves of the noise, normalized back to [0, 1]
+   @param octaves Number of octaves
+   @param lacunarity Frequency factor between two octaves
+   @param gain Amplitude factor between two octaves
+   */
+  static float fbm(float x, float y, float z, int octaves, float lacunarity = 2.0f, float gain = 0.5f) {
+    float sum = 0.0f;
+    float amplitude = 1.0f;
+    float total = 0.0f;
+    float frequency = 1.0f;
+    for (int o = 0; o < octaves; o++) {
+      sum += amplitude * noise(x * frequency, y * frequency, z * frequency);
+      total += amplitude;
+      amplitude *= gain;
+      frequency *= lacunarity;
+    }
+    return sum / total;
+  }
+
+  /**
+   Noise at any number of points, LANES (or WIDE_LANES with AVX2) points at a time
+   @param x, y, z Coordinates of the points
+   @param out Noise at every point
+   @param count Number of points
+   */
+  static void noise(const float *x, const float *y, const float *z, float *out, int count) {
+    fbm(x, y, z, out, count, 1);
+  }
+
+  /**
+   Fractal sum of octaves of the noise at any number of points, see fbm for one point
+   @param x, y, z Coordinates of the points
+   @param out Sum at every point
+   @param count Number of points
+   */
+  static void fbm(const float *x, const float *y, const float *z, float *out, int count, int octaves,
+                  float lacunarity = 2.0f, float gain = 0.5f) {
+    int i = 0;
+#ifdef __AVX2__
+    for (; i + WIDE_LANES <= count; i += WIDE_LANES)
+      _mm256_storeu_ps(out + i, fbm8(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i),
+                                     octaves, lacunarity, gain));
+#endif
+#ifdef __SSE2__
+    for (; i + LANES <= count; i += LANES)
+      _mm_storeu_ps(out + i, fbm4(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i), _mm_loadu_ps(z + i),
+                                  octaves, lacunarity, gain));
+#endif
+    for (; i < count; i++)
+      out[i] = fbm(x[i], y[i], z[i], octaves, lacunarity, gain);
+  }
+
+#ifdef __SSE2__
+  /** Noise at four points*/
+  static __m128 noise4(__m128 x, __m128 y, __m128 z) {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 fx = floor4(x);
+    __m128 fy = floor4(y);
+    __m128 fz = floor4(z);
+    const __m128i mask = _mm_set1_epi32(MASK);
+    alignas(16) int32_t X[4], Y[4], Z[4];
+    _mm_store_si128((__m128i *) X, _mm_and_si128(_mm_cvttps_epi32(fx), mask));
+    _mm_store_si128((__m128i *) Y, _mm_and_si128(_mm_cvttps_epi32(fy), mask));
+    _mm_store_si128((__m128i *) Z, _mm_and_si128(_mm_cvttps_epi32(fz), mask));
+    x = _mm_sub_ps(x, fx);
+    y = _mm_sub_ps(y, fy);
+    z = _mm_sub_ps(z, fz);
+
+    // SSE2 has no gather, the hashes of the corners are looked up lane by lane
+    alignas(16) int32_t h[8][4];
+    const int32_t *p = table.p;
+    for (int l = 0; l < 4; l++) {
+      int A = p[X[l]] + Y[l];
+      int AA = p[A] + Z[l];
+      int AB = p[A + 1] + Z[l];
+      int B = p[X[l] + 1] + Y[l];
+      int BA = p[B] + Z[l];
+      int BB = p[B + 1] + Z[l];
+      h[0][l] = p[AA];
+      h[1][l] = p[BA];
+      h[2][l] = p[AB];
+      h[3][l] = p[BB];
+      h[4][l] = p[AA + 1];
+      h[5][l] = p[BA + 1];
+      h[6][l] = p[AB + 1];
+      h[7][l] = p[BB + 1];
+    }
+
+    __m128 u = fade4(x);
+    __m128 v = fade4(y);
+    __m128 w = fade4(z);
+    __m128 x1 = _mm_sub_ps(x, one);
+    __m128 y1 = _mm_sub_ps(y, one);
+    __m128 z1 = _mm_sub_ps(z, one);
+    __m128 res = lerp4(w, lerp4(v, lerp4(u, grad4(load(h[0]), x, y, z), grad4(load(h[1]), x1, y, z)),
+                                lerp4(u, grad4(load(h[2]), x, y1, z), grad4(load(h[3]), x1, y1, z))),
+                       lerp4(v, lerp4(u, grad4(load(h[4]), x, y, z1), grad4(load(h[5]), x1, y, z1)),
+                             lerp4(u, grad4(load(h[6]), x, y1, z1), grad4(load(h[7]), x1, y1, z1))));
+    return _mm_mul_ps(_mm_add_ps(res, one), _mm_set1_ps(0.5f));
+  }
+
+  /** Fractal sum of octaves of the noise at four points*/
+  static __m128 fbm4(__m128 x, __m128 y, __m128 z, int octaves, float lacunarity = 2.0f, float gain = 0.5f) {
+    __m128 sum = _mm_setzero_ps();
+    float amplitude = 1.0f;
+    float total = 0.0f;
+    float frequency = 1.0f;
+    for (int o = 0; o < octaves; o++) {
+      __m128 f = _mm_set1_ps(frequency);
+      __m128 n = noise4(_mm_mul_ps(x, f), _mm_mul_ps(y, f), _mm_mul_ps(z, f));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(amplitude), n));
+      total += amplitude;
+      amplitude *= gain;
+      frequency *= lacunarity;
+    }
+    return _mm_div_ps(sum, _mm_set1_ps(total));
+  }
+#endif
+
+#ifdef __AVX2__
+  /** Noise at eight points, the hashes are gathered from the table*/
+  static __m256 noise8(__m256 x, __m256 y, __m256 z) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 fx = _mm256_floor_ps(x);
+    __m256 fy = _mm256_floor_ps(y);
+    __m256 fz = _mm256_floor_ps(z);
+    const __m256i mask = _mm256_set1_epi32(MASK);
+    const __m256i int_one = _mm256_set1_epi32(1);
+    __m256i X = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+    __m256i Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+    __m256i Z = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+    x = _mm256_sub_ps(x, fx);
+    y = _mm256_sub_ps(y, fy);
+    z = _mm256_sub_ps(z, fz);
+
+    const int *p = (const int *) table.p;
+    __m256i A = _mm256_add_epi32(_mm256_i32gather_epi32(p, X, 4), Y);
+    __m256i AA = _mm256_add_epi32(_mm256_i32gather_epi32(p, A, 4), Z);
+    __m256i AB = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(A, int_one), 4), Z);
+    __m256i B = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(X, int_one), 4), Y);
+    __m256i BA = _mm256_add_epi32(_mm256_i32gather_epi32(p, B, 4), Z);
+    __m256i BB = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(B, int_one), 4), Z);
+
+    __m256 u = fade8(x);
+    __m256 v = fade8(y);
+    __m256 w = fade8(z);
+    __m256 x1 = _mm256_sub_ps(x, one);
+    __m256 y1 = _mm256_sub_ps(y, one);
+    __m256 z1 = _mm256_sub_ps(z, one);
+    __m256 res = lerp8(w, lerp8(v, lerp8(u, grad8(gather(AA, 0), x, y, z), grad8(gather(BA, 0), x1, y, z)),
+                                lerp8(u, grad8(gather(AB, 0), x, y1, z), grad8(gather(BB, 0), x1, y1, z))),
+                       lerp8(v, lerp8(u, grad8(gather(AA, 1), x, y, z1), grad8(gather(BA, 1), x1, y, z1)),
+                             lerp8(u, grad8(gather(AB, 1), x, y1, z1), grad8(gather(BB, 1), x1, y1, z1))));
+    return _mm256_mul_ps(_mm256_add_ps(res, one), _mm256_set1_ps(0.5f));
+  }
+
+  /** Fractal sum of octaves of the noise at eight points*/
+  static __m256 fbm8(__m256 x, __m256 y, __m256 z, int octaves, float lacunarity = 2.0f, float gain = 0.5f) {
+    __m256 sum = _mm256_setzero_ps();
+    float amplitude = 1.0f;
+    float total = 0.0f;
+    float frequency = 1.0f;
+    for (int o = 0; o < octaves; o++) {
+      __m256 f = _mm256_set1_ps(frequency);
+      __m256 n = noise8(_mm256_mul_ps(x, f), _mm256_mul_ps(y, f), _mm256_mul_ps(z, f));
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(amplitude), n));
+      total += amplitude;
+      amplitude *= gain;
+      frequency *= lacunarity;
+    }
+    return _mm256_div_ps(sum, _mm256_set1_ps(total));
+  }
+#endif
+
+ private:
+  static float fade(float t) {
+    return t * t * t * (t * (t * 6 - 15) + 10);
+  }
+  static float lerp(float t, float a, float b) {
+    return a + t * (b - a);
+  }
+  static float grad(int hash, float x, float y, float z) {
+    int h = hash & 15;
+    // Convert lower 4 bits of hash into 12 gradient directions
+    float u = h < 8 ? x : y,
+        v = h < 4 ? y : h == 12 || h == 14 ? x : z;
+    return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+  }
+
+#ifdef __SSE2__
+  static __m128i load(const int32_t *hashes) {
+    return _mm_load_si128((const __m128i *) hashes);
+  }
+  /** floor for SSE2, which only truncates*/
+  static __m128 floor4(__m128 x) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+  }
+  static __m128 fade4(__m128 t) {
+    __m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))),
+                              _mm_set1_ps(10.0f));
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+  }
+  static __m128 lerp4(__m128 t, __m128 a, __m128 b) {
+    return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+  }
+  static __m128 select4(__m128i mask, __m128 a, __m128 b) {
+    __m128 m = _mm_castsi128_ps(mask);
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+  }
+  static __m128 grad4(__m128i hash, __m128 x, __m128 y, __m128 z) {
+    __m128i h = _mm_and_si128(hash, _mm_set1_epi32(15));
+    __m128 u = select4(_mm_cmplt_epi32(h, _mm_set1_epi32(8)), x, y);
+    __m128i x_for_v = _mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14)));
+    __m128 v = select4(_mm_cmplt_epi32(h, _mm_set1_epi32(4)), y, select4(x_for_v, x, z));
+    // bits 0 and 1 of the hash flip the signs of u and v
+    __m128 u_sign = _mm_castsi128_ps(_mm_slli_epi32(h, 31));
+    __m128 v_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(h, 1), 31));
+    return _mm_add_ps(_mm_xor_ps(u, u_sign), _mm_xor_ps(v, v_sign));
+  }
+#endif
+
+#ifdef __AVX2__
+  static __m256i gather(__m256i index, int offset) {
+    return _mm256_i32gather_epi32((const int *) table.p, _mm256_add_epi32(index, _mm256_set1_epi32(offset)), 4);
+  }
+  static __m256 fade8(__m256 t) {
+    // no fused multiply-add, which would round differently from fade and need -mfma on top of -mavx2
+    __m256 inner = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)),
+                                                                _mm256_set1_ps(15.0f))),
+                                 _mm256_set1_ps(10.0f));
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), inner);
+  }
+  static __m256 lerp8(__m256 t, __m256 a, __m256 b) {
+    return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+  }
+  static __m256 grad8(__m256i hash, __m256 x, __m256 y, __m256 z) {
+    __m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+    __m256 u = _mm256_blendv_ps(y, x, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h)));
+    __m256i x_for_v = _mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+                                      _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14)));
+    __m256 v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, _mm256_castsi256_ps(x_for_v)), y,
+                                _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h)));
+    __m256 u_sign = _mm256_castsi256_ps(_mm256_slli_epi32(h, 31));
+    __m256 v_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(h, 1), 31));
+    return _mm256_add_ps(_mm256_xor_ps(u, u_sign), _mm256_xor_ps(v, v_sign));
+  }
+#endif
+};
+
+#endif //USI_RENDERING_COMPETITION__PERLINENGINE_H_
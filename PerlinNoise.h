@@ -4,6 +4,7 @@
 
 #ifndef USI_RENDERING_COMPETITION__PERLINNOISE_H_
 #define USI_RENDERING_COMPETITION__PERLINNOISE_H_
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <numeric>
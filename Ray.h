@@ -4,6 +4,9 @@
 
 #ifndef TEMPLATE__RAY_H_
 #define TEMPLATE__RAY_H_
+
+#include <cstdint>
+
 /**
  Class representing a single ray.
  */
@@ -20,6 +23,61 @@ class Ray {
   Ray(glm::vec3 origin, glm::vec3 direction) : origin(origin), direction(direction) {
     this->position = origin+position;
   }
+  Ray() = default;
+};
+
+/** Spreads the lowest 10 bits of a number so that there are two zero bits between any two of them*/
+inline uint32_t spread_bits(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+/**
+ Key ordering rays by the octant of their direction, then along a Morton curve through their origins
+ @param ray The ray
+ @param lo Minimum corner of the box containing the origins
+ @param hi Maximum corner of the box containing the origins
+ */
+inline uint32_t sort_key(const Ray &ray, glm::vec3 lo, glm::vec3 hi) {
+  uint32_t octant = (ray.direction.x < 0 ? 1u : 0u) | (ray.direction.y < 0 ? 2u : 0u) | (ray.direction.z < 0 ? 4u : 0u);
+  glm::vec3 extent = glm::max(hi - lo, glm::vec3(1e-12f));
+  glm::vec3 cell = glm::clamp((ray.origin - lo) / extent * 1023.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+  uint32_t morton = spread_bits((uint32_t) cell.x) | (spread_bits((uint32_t) cell.y) << 1) |
+      (spread_bits((uint32_t) cell.z) << 2);
+  return (octant << 29) | (morton >> 1);
+}
+
+/**
+ A group of up to 16 rays traced together through the scene.
+ The coordinates are stored per axis so that the rays can be tested four at a time.
+ */
+struct RayPacket {
+  static const int MAX = 16; ///< Largest supported packet
+  int size = 0; ///< Number of rays in the packet, a multiple of 4
+  alignas(16) float origin[3][MAX]; ///< Origins of the rays, per axis
+  alignas(16) float direction[3][MAX]; ///< Directions of the rays, per axis
+  alignas(16) float inv_direction[3][MAX]; ///< Component-wise inverse of the directions, per axis
+
+  /** Sets one ray of the packet*/
+  void set(int i, const Ray &ray) {
+    for (int axis = 0; axis < 3; axis++) {
+      origin[axis][i] = ray.origin[axis];
+      direction[axis][i] = ray.direction[axis];
+      inv_direction[axis][i] = 1.0f / ray.direction[axis];
+    }
+  }
+  Ray ray(int i) const {
+    return {glm::vec3(origin[0][i], origin[1][i], origin[2][i]),
+            glm::vec3(direction[0][i], direction[1][i], direction[2][i])};
+  }
+  /** Mask with one bit set for every ray of the packet*/
+  uint32_t all() const {
+    return size >= 32 ? 0xffffffffu : (1u << size) - 1;
+  }
 };
 
 #endif //TEMPLATE__RAY_H_
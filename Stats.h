@@ -0,0 +1,123 @@
+//
+// Created by Volodymyr Karpenko on 05.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__STATS_H_
+#define USI_RENDERING_COMPETITION__STATS_H_
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+using namespace std;
+
+/** Set RENDER_STATS to 0, e.g. with the RENDER_STATS CMake option, to compile every counter and timer out*/
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+
+/** Events counted while rendering*/
+enum StatCounter {
+  CAMERA_RAYS, SHADOW_RAYS, REFLECTION_RAYS, REFRACTION_RAYS, NODE_VISITS, PRIMITIVE_TESTS, SHADING_CALLS,
+  STAT_COUNTERS
+};
+
+/** Phases of a run timed with the wall clock*/
+enum StatPhase {
+  LOAD_PHASE, BUILD_PHASE, RENDER_PHASE, WRITE_PHASE, STAT_PHASES
+};
+
+const char *const stat_counter_names[STAT_COUNTERS] = {
+    "camera_rays", "shadow_rays", "reflection_rays", "refraction_rays", "node_visits", "primitive_tests",
+    "shading_calls"
+};
+
+const char *const stat_phase_names[STAT_PHASES] = {"load", "build", "render", "write"};
+
+thread_local uint64_t stat_counts[STAT_COUNTERS]; ///< Counters of the thread since its last flush
+
+/**
+ Counters and phase times of the render. Every thread increments its own thread_local counters, which cost no more
+ than a plain increment, and adds them to the shared totals when it finishes a task
+ */
+class RenderStats {
+ private:
+  atomic<uint64_t> totals[STAT_COUNTERS] = {};
+
+ public:
+  double phase_seconds[STAT_PHASES] = {}; ///< Wall-clock time of every phase
+
+  /** Adds the counters of the calling thread to the totals and clears them*/
+  void flush() {
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+      totals[c] += stat_counts[c];
+      stat_counts[c] = 0;
+    }
+  }
+
+  /** Sum of a counter over the flushed counters of all the threads*/
+  uint64_t total(StatCounter counter) const {
+    return totals[counter];
+  }
+
+  /** Writes the counters and the phase times as a table*/
+  void print(ostream &out) const {
+    out << "Statistics" << endl;
+    for (int c = 0; c < STAT_COUNTERS; c++)
+      out << "  " << left << setw(18) << stat_counter_names[c] << right << setw(16) << total((StatCounter) c) << endl;
+    for (int p = 0; p < STAT_PHASES; p++)
+      out << "  " << left << setw(18) << stat_phase_names[p] << right << setw(14) << fixed << setprecision(3)
+          << phase_seconds[p] << " s" << endl;
+    out.unsetf(ios::fixed);
+  }
+
+  /** Writes the counters and the phase times as a JSON object*/
+  void write_json(ostream &out) const {
+    out << "{\n  \"counters\": {";
+    for (int c = 0; c < STAT_COUNTERS; c++)
+      out << (c ? ", " : "") << "\"" << stat_counter_names[c] << "\": " << total((StatCounter) c);
+    out << "},\n  \"phases\": {";
+    for (int p = 0; p < STAT_PHASES; p++)
+      out << (p ? ", " : "") << "\"" << stat_phase_names[p] << "\": " << phase_seconds[p];
+    out << "}\n}" << endl;
+  }
+};
+
+RenderStats render_stats;
+
+/** Adds the wall-clock time from its construction until it is stopped or destroyed to a phase*/
+class PhaseTimer {
+ private:
+  StatPhase phase;
+  chrono::steady_clock::time_point start;
+  bool running = true;
+
+ public:
+  explicit PhaseTimer(StatPhase phase) : phase(phase), start(chrono::steady_clock::now()) {
+  }
+
+  void stop() {
+    if (!running)
+      return;
+    running = false;
+    render_stats.phase_seconds[phase] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  ~PhaseTimer() {
+    stop();
+  }
+};
+
+#if RENDER_STATS
+#define STAT_ADD(counter, n) (stat_counts[counter] += (n))
+#define STAT_TIMER(name, phase) PhaseTimer name(phase)
+#define STAT_TIMER_STOP(name) name.stop()
+#else
+#define STAT_ADD(counter, n) ((void) 0)
+#define STAT_TIMER(name, phase) ((void) 0)
+#define STAT_TIMER_STOP(name) ((void) 0)
+#endif
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+
+#endif //USI_RENDERING_COMPETITION__STATS_H_
@@ -0,0 +1,240 @@
+//
+// Created by Volodymyr Karpenko on 21.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION__TEXTURECACHE_H_
+#define USI_RENDERING_COMPETITION__TEXTURECACHE_H_
+#include <cmath>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "glm/glm.hpp"
+#include "Textures.h"
+
+using namespace std;
+
+typedef glm::vec3 (*Texture)(glm::vec2 uv); ///< Procedural texture, as stored in Material::texture
+
+/**
+ Cache of procedural textures baked into mip-mapped float images.
+ The uv plane is cut into square tiles of side extent; a tile is baked the first time it is sampled, with
+ resolution texels across at level 0 and one level per halving down to a single texel. Every level stores its
+ samples at the texel corners, one more than the texels per side, so that bilinear filtering never needs
+ the neighbouring tiles. The least recently used tiles are evicted once the baked tiles exceed the memory cap.
+ Every thread keeps the tiles it used last in a small direct-mapped table, so that most lookups take neither the
+ lock nor a reference count; the shared recency of a tile is only refreshed every BUMP_INTERVAL local hits.
+ */
+class TextureCache {
+ private:
+  struct Tile {
+    vector<vector<glm::vec3>> levels; ///< Corner samples of every level, row after row
+  };
+  typedef tuple<Texture, int, int> Key; ///< Texture and position of a tile in the uv plane
+  typedef list<pair<Key, shared_ptr<const Tile>>> Recency; ///< Baked tiles, the most recently used first
+
+  /** Tile recently used by a thread*/
+  struct LocalSlot {
+    const TextureCache *owner = nullptr;
+    Key key;
+    shared_ptr<const Tile> tile; ///< Keeps the tile alive for the thread, even once it is evicted from the cache
+    size_t pending = 0; ///< Hits not yet added to hits and to the recency of the tile
+  };
+  static const int LOCAL_SLOTS = 32;
+  static const size_t BUMP_INTERVAL = 256;
+
+  Recency recency;
+  map<Key, Recency::iterator> tiles;
+  size_t bytes = 0;
+  mutex lock;
+
+  /** Table of the tiles used last by the calling thread, indexed by a hash of their key*/
+  static LocalSlot *local_slots() {
+    thread_local LocalSlot slots[LOCAL_SLOTS];
+    return slots;
+  }
+
+  /** Adds the pending hits of a slot to the cache and makes its tile the most recently used*/
+  void touch(LocalSlot &slot) {
+    lock_guard<mutex> guard(lock);
+    auto found = tiles.find(slot.key);
+    if (found != tiles.end())
+      recency.splice(recency.begin(), recency, found->second);
+    hits += slot.pending;
+    slot.pending = 0;
+  }
+
+  size_t tile_bytes() const {
+    size_t total = 0;
+    for (int n = resolution; n >= 1; n /= 2)
+      total += (size_t) (n + 1) * (n + 1) * sizeof(glm::vec3);
+    return total + sizeof(Tile);
+  }
+
+  shared_ptr<const Tile> bake(Texture texture, int tx, int ty) const {
+    auto tile = make_shared<Tile>();
+    int n = resolution;
+    vector<glm::vec3> level((size_t) (n + 1) * (n + 1));
+    // textures with a row form, as perlinNoise, evaluate the n + 1 samples of a row together with SIMD
+    TextureRow row = texture_row(texture);
+    vector<glm::vec2> uv(n + 1);
+    for (int j = 0; j <= n; j++) {
+      for (int i = 0; i <= n; i++)
+        uv[i] = glm::vec2(((float) tx + (float) i / (float) n) * extent, ((float) ty + (float) j / (float) n) * extent);
+      if (row) {
+        row(uv.data(), &level[j * (n + 1)], n + 1);
+      } else {
+        for (int i = 0; i <= n; i++)
+          level[j * (n + 1) + i] = texture(uv[i]);
+      }
+    }
+    tile->levels.push_back(move(level));
+    // each coarser level filters the finer one with a [1 2 1] tent around the matching corner
+    for (n /= 2; n >= 1; n /= 2) {
+      const vector<glm::vec3> &fine = tile->levels.back();
+      int fine_n = 2 * n;
+      auto at = [&](int i, int j) {
+        return fine[glm::clamp(j, 0, fine_n) * (fine_n + 1) + glm::clamp(i, 0, fine_n)];
+      };
+      vector<glm::vec3> coarse((size_t) (n + 1) * (n + 1));
+      for (int j = 0; j <= n; j++)
+        for (int i = 0; i <= n; i++) {
+          glm::vec3 sum(0.0f);
+          for (int dj = -1; dj <= 1; dj++)
+            for (int di = -1; di <= 1; di++)
+              sum += (float) ((2 - abs(di)) * (2 - abs(dj))) * at(2 * i + di, 2 * j + dj);
+          coarse[j * (n + 1) + i] = sum / 16.0f;
+        }
+      tile->levels.push_back(move(coarse));
+    }
+    return tile;
+  }
+
+  /** Finds a tile in the shared cache, baking it when it is missing*/
+  shared_ptr<const Tile> find_shared(Texture texture, int tx, int ty) {
+    Key key(texture, tx, ty);
+    {
+      lock_guard<mutex> guard(lock);
+      auto found = tiles.find(key);
+      if (found != tiles.end()) {
+        recency.splice(recency.begin(), recency, found->second);
+        hits++;
+        return found->second->second;
+      }
+      misses++;
+    }
+    // baked without holding the lock, another thread may bake the same tile meanwhile
+    shared_ptr<const Tile> tile = bake(texture, tx, ty);
+    lock_guard<mutex> guard(lock);
+    if (tiles.count(key))
+      return tile;
+    recency.emplace_front(key, tile);
+    tiles[key] = recency.begin();
+    bytes += tile_bytes();
+    while (bytes > capacity && recency.size() > 1) {
+      tiles.erase(recency.back().first);
+      recency.pop_back();
+      bytes -= tile_bytes();
+      evictions++;
+    }
+    return tile;
+  }
+
+  /** Finds a tile through the table of the calling thread first*/
+  const Tile *find(Texture texture, int tx, int ty) {
+    Key key(texture, tx, ty);
+    size_t hash = (size_t) texture ^ (size_t) tx * 73856093u ^ (size_t) ty * 19349663u;
+    LocalSlot &slot = local_slots()[hash % LOCAL_SLOTS];
+    if (slot.owner == this && slot.key == key) {
+      if (++slot.pending >= BUMP_INTERVAL)
+        touch(slot);
+      return slot.tile.get();
+    }
+    if (slot.owner == this && slot.pending > 0)
+      touch(slot);
+    slot.owner = this;
+    slot.key = key;
+    slot.tile = find_shared(texture, tx, ty);
+    return slot.tile.get();
+  }
+
+  /** Bilinear lookup in one level of a tile, st are the coordinates inside the tile in [0, 1]*/
+  glm::vec3 bilinear(const Tile &tile, int level, glm::vec2 st) const {
+    int n = resolution >> level;
+    const vector<glm::vec3> &samples = tile.levels[level];
+    glm::vec2 p = glm::clamp(st * (float) n, glm::vec2(0.0f), glm::vec2((float) n));
+    int i = min((int) p.x, n - 1);
+    int j = min((int) p.y, n - 1);
+    float fx = p.x - (float) i;
+    float fy = p.y - (float) j;
+    const glm::vec3 *row = &samples[j * (n + 1) + i];
+    glm::vec3 bottom = glm::mix(row[0], row[1], fx);
+    glm::vec3 top = glm::mix(row[n + 1], row[n + 2], fx);
+    return glm::mix(bottom, top, fy);
+  }
+
+ public:
+  int resolution = 64; ///< Texels across a tile at level 0, a power of two
+  float extent = 1.0f; ///< Side of a tile in uv units
+  size_t capacity = 64u << 20; ///< Memory cap of the baked tiles in bytes
+  bool trilinear = false; ///< Whether the level is chosen from the footprint, otherwise level 0 is always sampled
+  size_t hits = 0; ///< Lookups finding their tile baked
+  size_t misses = 0; ///< Lookups baking their tile
+  size_t evictions = 0; ///< Tiles dropped to stay under the memory cap
+
+  /**
+   Samples a procedural texture through the cache
+   @param texture The procedural texture
+   @param uv Texture coordinates
+   @param footprint Width in uv units covered by the sample, selects the mip levels with trilinear filtering
+   @return Filtered color of the texture
+   */
+  glm::vec3 sample(Texture texture, glm::vec2 uv, float footprint) {
+    glm::vec2 cell = uv / extent;
+    glm::vec2 corner = glm::floor(cell);
+    const Tile *tile = find(texture, (int) corner.x, (int) corner.y);
+    glm::vec2 st = cell - corner;
+    if (!trilinear)
+      return bilinear(*tile, 0, st);
+
+    float texel = extent / (float) resolution;
+    float lod = footprint > texel ? log2(footprint / texel) : 0.0f;
+    lod = min(lod, (float) (tile->levels.size() - 1));
+    int level = (int) lod;
+    if (level + 1 >= (int) tile->levels.size())
+      return bilinear(*tile, level, st);
+    return glm::mix(bilinear(*tile, level, st), bilinear(*tile, level + 1, st), lod - (float) level);
+  }
+
+  /** Adds the hits the calling thread has not reported yet to hits, to be called when it finishes a task*/
+  void flush() {
+    LocalSlot *slots = local_slots();
+    for (int k = 0; k < LOCAL_SLOTS; k++)
+      if (slots[k].owner == this && slots[k].pending > 0)
+        touch(slots[k]);
+  }
+
+  /** Number of tiles currently baked*/
+  size_t size() {
+    lock_guard<mutex> guard(lock);
+    return recency.size();
+  }
+};
+
+TextureCache *texture_cache = nullptr; ///< Cache of baked textures, procedural textures are evaluated directly when null
+
+/**
+ Evaluates the texture of a material, through the baked texture cache when it is enabled
+ @param texture The procedural texture
+ @param uv Texture coordinates
+ @param footprint Width in uv units covered by the shading point
+ */
+glm::vec3 texture_lookup(Texture texture, glm::vec2 uv, float footprint) {
+  if (texture_cache)
+    return texture_cache->sample(texture, uv, footprint);
+  return texture(uv);
+}
+
+#endif //USI_RENDERING_COMPETITION__TEXTURECACHE_H_
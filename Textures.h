@@ -8,13 +8,9 @@
 #ifndef Textures_h
 #define Textures_h
 
+#include <vector>
 #include "glm/glm.hpp"
-#include "PerlinNoise.h"
-
-PerlinNoise pn;
-PerlinNoise pn1(2016, 1024);
-PerlinNoise pn2(310, 2048);
-PerlinNoise pn3(120412, 4096);
+#include "PerlinEngine.h"
 
 glm::vec3 checkerboardTexture(glm::vec2 uv) {
   float n = 20;
@@ -33,15 +29,38 @@ glm::vec3 rainbowTexture(glm::vec2 uv) {
   }
 }
 
+/**
+ Perlin noise texture. The color is the normalized gray of the noise, so only one noise evaluation is needed;
+ the octaves of PerlinEngine::fbm are available for textures that keep the magnitude.
+ */
 glm::vec3 perlinNoise(glm::vec2 uv) {
-  float n1 = (float) (pn.noise(uv.x, uv.y, 1.0) +
-      pn1.noise(uv.x, uv.y, 1.0) +
-      pn2.noise(uv.x, uv.y, 1.0) +
-      pn3.noise(uv.x, uv.y, 1.0)) / 4.f;
-  float n2 = (float) (pn.noise(uv.x, uv.y, 1.0) +
-      pn1.noise(uv.x, uv.y, 1.0)) / 4.f;
-  float n3 = (float) (pn.noise(uv.x, uv.y, 1.0)) / 4.f;
-  return glm::normalize(glm::vec3((float) pn3.noise(uv.x, uv.y, 1.0)));
+  return glm::normalize(glm::vec3(PerlinEngine::noise(uv.x, uv.y, 1.0f)));
+}
+
+/**
+ perlinNoise at a row of points, evaluated LANES (or WIDE_LANES) points at a time by PerlinEngine
+ @param uv Texture coordinates of the points
+ @param colors Color at every point, the same as perlinNoise returns
+ @param count Number of points
+ */
+void perlinNoiseRow(const glm::vec2 *uv, glm::vec3 *colors, int count) {
+  std::vector<float> x(count), y(count), z(count, 1.0f), noise(count);
+  for (int i = 0; i < count; i++) {
+    x[i] = uv[i].x;
+    y[i] = uv[i].y;
+  }
+  PerlinEngine::noise(x.data(), y.data(), z.data(), noise.data(), count);
+  for (int i = 0; i < count; i++)
+    colors[i] = glm::normalize(glm::vec3(noise[i]));
+}
+
+typedef void (*TextureRow)(const glm::vec2 *uv, glm::vec3 *colors, int count); ///< Texture evaluated at many points
+
+/** Version of a texture evaluating a row of points at once, nullptr when the texture only has the one-point form*/
+TextureRow texture_row(glm::vec3 (*texture)(glm::vec2 uv)) {
+  if (texture == perlinNoise)
+    return perlinNoiseRow;
+  return nullptr;
 }
 
 #endif /* Textures_h */
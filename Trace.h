@@ -0,0 +1,156 @@
+//
+// Created by Volodymyr Karpenko on 12.01.22.
+//
+
+#ifndef USI_RENDERING_COMPETITION__TRACE_H_
+#define USI_RENDERING_COMPETITION__TRACE_H_
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** One event of the timeline, see the Trace Event Format of chrome://tracing*/
+struct TraceEvent {
+  string name;
+  const char *category;
+  char phase; ///< 'X' for a span, 'b' and 'e' for the start and end of an asynchronous span
+  double start; ///< Microseconds since the recorder was created
+  double duration; ///< Microseconds, spans only
+  uint64_t id; ///< Pairs the start and end of an asynchronous span
+};
+
+/** Events of one thread, appended by that thread only*/
+struct TraceTrack {
+  int id;
+  string name;
+  vector<TraceEvent> events;
+};
+
+/**
+ Timeline of a run written as Chrome trace-event JSON, to be opened in chrome://tracing or Perfetto. Every thread
+ records into its own track without locking, the lock is only taken the first time a thread records an event.
+ Nothing is recorded unless the recorder is enabled
+ */
+class TraceRecorder {
+ private:
+  chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+  mutex tracks_mutex;
+  vector<unique_ptr<TraceTrack>> tracks;
+  atomic<uint64_t> next_id{0};
+
+ public:
+  bool enabled = false;
+
+  /** Microseconds since the recorder was created*/
+  double now() const {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+  }
+
+  /** Track of the calling thread, created and named "worker n" the first time the thread records*/
+  TraceTrack &track() {
+    thread_local TraceTrack *local = nullptr;
+    if (!local) {
+      lock_guard<mutex> lock(tracks_mutex);
+      int id = (int) tracks.size();
+      tracks.push_back(make_unique<TraceTrack>(TraceTrack{id, "worker " + to_string(id), {}}));
+      local = tracks.back().get();
+    }
+    return *local;
+  }
+
+  /** Names the track of the calling thread*/
+  void name_thread(const string &name) {
+    track().name = name;
+  }
+
+  /** Records a span of the calling thread*/
+  void span(const string &name, const char *category, double start, double end) {
+    track().events.push_back({name, category, 'X', start, end - start, 0});
+  }
+
+  /** Records an asynchronous span, drawn apart from the spans of the thread since it may overlap them*/
+  void async_span(const string &name, const char *category, double start, double end) {
+    uint64_t id = next_id++;
+    TraceTrack &local = track();
+    local.events.push_back({name, category, 'b', start, 0.0, id});
+    local.events.push_back({name, category, 'e', end, 0.0, id});
+  }
+
+  /** Writes the events of all the threads, which must not be recording anymore*/
+  void write_json(ostream &out) {
+    lock_guard<mutex> lock(tracks_mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (auto &track: tracks) {
+      out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << track->id
+          << ", \"args\": {\"name\": \"" << track->name << "\"}}";
+      first = false;
+      for (auto &event: track->events) {
+        out << ",\n{\"ph\": \"" << event.phase << "\", \"name\": \"" << event.name << "\", \"cat\": \""
+            << event.category << "\", \"pid\": 1, \"tid\": " << track->id << ", \"ts\": " << fixed << event.start;
+        if (event.phase == 'X')
+          out << ", \"dur\": " << event.duration;
+        else
+          out << ", \"id\": " << event.id;
+        out << "}";
+      }
+    }
+    out << "\n]}" << endl;
+    out.unsetf(ios::fixed);
+  }
+};
+
+TraceRecorder trace_recorder;
+
+/** Records a span of the calling thread from its construction until it is stopped or destroyed*/
+class TraceScope {
+ private:
+  const char *name;
+  const char *category;
+  double start;
+  bool running;
+
+ public:
+  TraceScope(const char *name, const char *category)
+      : name(name), category(category), start(0.0), running(trace_recorder.enabled) {
+    if (running)
+      start = trace_recorder.now();
+  }
+
+  void stop() {
+    if (!running)
+      return;
+    running = false;
+    trace_recorder.span(name, category, start, trace_recorder.now());
+  }
+
+  ~TraceScope() {
+    stop();
+  }
+};
+
+/**
+ Wraps a task of the thread pool so that it records the time it waited in the queue and the time it ran, on the
+ track of the thread that ran it
+ @param name Name of the task in the timeline
+ @param task The task
+ */
+function<void()> traced_task(const string &name, function<void()> task) {
+  if (!trace_recorder.enabled)
+    return task;
+  double queued = trace_recorder.now();
+  return [name, task, queued]() {
+    double start = trace_recorder.now();
+    trace_recorder.async_span("wait " + name, "queue", queued, start);
+    task();
+    trace_recorder.span(name, "task", start, trace_recorder.now());
+  };
+}
+
+#endif //USI_RENDERING_COMPETITION__TRACE_H_
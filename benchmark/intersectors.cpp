@@ -0,0 +1,180 @@
+//
+// Created by Volodymyr Karpenko on 09.01.22.
+//
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "object/Sphere.h"
+#include "object/Plane.h"
+#include "object/Cone.h"
+#include "object/Triangle.h"
+#include "object/Figure.h"
+#include "Options.h"
+
+using namespace std;
+
+/** Sets of rays every intersector is measured with*/
+enum RaySet {
+  HIT_HEAVY, MISS_HEAVY, GRAZING, RAY_SETS
+};
+
+const char *const ray_set_names[RAY_SETS] = {"hit", "miss", "grazing"};
+
+/** An intersector under test and the generator of its rays*/
+struct Kernel {
+  string name;
+  Object *object;
+  function<Ray(RaySet, minstd_rand &)> ray; ///< Draws one ray of a set
+};
+
+/** Result of one intersector on one set of rays*/
+struct Measurement {
+  string kernel;
+  RaySet set;
+  double hit_rate;
+  double ns_per_ray;
+};
+
+/** Uniformly distributed unit vector*/
+glm::vec3 random_direction(minstd_rand &rng) {
+  normal_distribution<float> gauss(0.0f, 1.0f);
+  glm::vec3 d;
+  do {
+    d = glm::vec3(gauss(rng), gauss(rng), gauss(rng));
+  } while (glm::dot(d, d) < 1e-6f);
+  return glm::normalize(d);
+}
+
+/**
+ Rays around a bounded object, starting on a sphere of four times its bounding radius. Hit rays aim at points
+ within half the radius of the center, miss rays pass 1.5 to 3 radii beside it and grazing rays pass within 2%
+ of the bounding sphere, which is the silhouette of a sphere and close to the outline of the other shapes
+ @param center Center of the bounding sphere of the object
+ @param radius Radius of the bounding sphere
+ */
+function<Ray(RaySet, minstd_rand &)> bounded_rays(glm::vec3 center, float radius) {
+  return [center, radius](RaySet set, minstd_rand &rng) {
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    glm::vec3 origin = center + 4.0f * radius * random_direction(rng);
+    glm::vec3 forward = glm::normalize(center - origin);
+    glm::vec3 side = glm::normalize(glm::cross(forward, random_direction(rng)));
+    glm::vec3 target;
+    switch (set) {
+      case HIT_HEAVY: target = center + 0.5f * radius * uniform(rng) * random_direction(rng);
+        break;
+      case MISS_HEAVY: target = center + radius * (1.5f + 1.5f * uniform(rng)) * side;
+        break;
+      default: target = center + radius * (0.98f + 0.04f * uniform(rng)) * side;
+    }
+    return Ray(origin, glm::normalize(target - origin));
+  };
+}
+
+/**
+ Rays towards an infinite plane from above it: hit rays point down, miss rays point up and grazing rays make an
+ angle of less than a degree with the plane
+ */
+function<Ray(RaySet, minstd_rand &)> plane_rays(glm::vec3 point, glm::vec3 normal) {
+  return [point, normal](RaySet set, minstd_rand &rng) {
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    glm::vec3 d = random_direction(rng);
+    glm::vec3 along = glm::normalize(d - glm::dot(d, normal) * normal);
+    glm::vec3 offset = random_direction(rng);
+    glm::vec3 origin = point + 10.0f * (offset - glm::dot(offset, normal) * normal) + 2.0f * normal;
+    float slope;
+    switch (set) {
+      case HIT_HEAVY: slope = -(0.2f + uniform(rng));
+        break;
+      case MISS_HEAVY: slope = 0.2f + uniform(rng);
+        break;
+      default: slope = (2.0f * uniform(rng) - 1.0f) * 0.017f;
+    }
+    return Ray(origin, glm::normalize(along + slope * normal));
+  };
+}
+
+/**
+ Times queryHit over a fixed set of rays, repeating the set until the time budget is spent
+ @param kernel The intersector
+ @param set Which rays to trace
+ @param count Number of distinct rays
+ @param seconds Minimal measured time
+ */
+Measurement measure(const Kernel &kernel, RaySet set, int count, double seconds) {
+  minstd_rand rng(20220109u + (unsigned) set);
+  vector<Ray> rays;
+  rays.reserve(count);
+  for (int i = 0; i < count; i++)
+    rays.push_back(kernel.ray(set, rng));
+
+  long hits = 0;
+  long traced = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  double elapsed = 0.0;
+  while (elapsed < seconds) {
+    for (auto &ray: rays)
+      hits += kernel.object->queryHit(ray).hit;
+    traced += count;
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+  return {kernel.name, set, (double) hits / (double) traced, elapsed * 1e9 / (double) traced};
+}
+
+/**
+ Micro-benchmark of the intersectors of the renderer. Every intersector is timed on fixed-seed sets of hit-heavy,
+ miss-heavy and grazing rays.
+ Usage: intersector_benchmark [mesh.obj] [--rays=n] [--seconds=s] [--layout=tree|bvh|compact] [--json=path]
+ */
+int main(int argc, const char *argv[]) {
+  Options options = parse_options(argc, argv);
+  int count = options.get("rays", 1 << 16);
+  double seconds = options.get("seconds", 0.25f);
+
+  vector<Kernel> kernels;
+  kernels.push_back({"sphere", new Sphere(1.0f, glm::vec3(0.0f), white_diffuse),
+                     bounded_rays(glm::vec3(0.0f), 1.0f)});
+  kernels.push_back({"plane", new Plane(glm::vec3(0.0f), glm::vec3(0, 1, 0), white_diffuse),
+                     plane_rays(glm::vec3(0.0f), glm::vec3(0, 1, 0))});
+  kernels.push_back({"cone", new Cone(white_diffuse), bounded_rays(glm::vec3(0, 0.5f, 0), sqrt(1.25f))});
+  glm::vec3 a(-1, -0.5f, 0), b(1, -0.5f, 0), c(0, 1, 0);
+  kernels.push_back({"triangle", new Triangle(a, b, c), bounded_rays((a + b + c) / 3.0f, 1.0f)});
+  if (!options.positional.empty()) {
+    string layout_name = options.get("layout", "bvh");
+    MeshLayout layout = layout_name == "tree" ? MeshLayout::Tree
+                                              : (layout_name == "compact" ? MeshLayout::Compact : MeshLayout::Bvh);
+    auto *figure = new Figure(options.positional[0], false, layout);
+    AABB box = figure->bounds();
+    kernels.push_back({"figure", figure, bounded_rays(box.center(), 0.5f * glm::length(box.max - box.min))});
+  }
+
+  vector<Measurement> results;
+  cout << left << setw(10) << "kernel" << setw(10) << "rays" << right << setw(10) << "hit rate" << setw(12)
+       << "ns/ray" << setw(12) << "Mrays/s" << endl;
+  for (auto &kernel: kernels)
+    for (int set = 0; set < RAY_SETS; set++) {
+      Measurement m = measure(kernel, (RaySet) set, count, seconds);
+      results.push_back(m);
+      cout << left << setw(10) << m.kernel << setw(10) << ray_set_names[set] << right << fixed << setprecision(3)
+           << setw(10) << m.hit_rate << setw(12) << m.ns_per_ray << setw(12) << 1e3 / m.ns_per_ray << endl;
+    }
+
+  if (options.has("json")) {
+    ofstream json(options.get("json", "intersectors.json"));
+    json << "{\n  \"rays\": " << count << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      const Measurement &m = results[i];
+      json << "    {\"kernel\": \"" << m.kernel << "\", \"rays\": \"" << ray_set_names[m.set] << "\", \"hit_rate\": "
+           << m.hit_rate << ", \"ns_per_ray\": " << m.ns_per_ray << ", \"mrays_per_s\": " << 1e3 / m.ns_per_ray
+           << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}" << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+//
+// Created by Volodymyr Karpenko on 15.01.22.
+//
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "glm/glm.hpp"
+#include "PerlinEngine.h"
+#include "Textures.h"
+#include "Options.h"
+
+using namespace std;
+
+/** Runs a function over and over until the time budget is spent, returns the nanoseconds per point*/
+template<class Run>
+double time_per_point(Run run, int points, double seconds) {
+  long runs = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  double elapsed = 0.0;
+  while (elapsed < seconds) {
+    run();
+    runs++;
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+  return elapsed * 1e9 / ((double) runs * points);
+}
+
+/**
+ Checks that the SIMD Perlin noise of PerlinEngine, and the row form of the perlinNoise texture baked by the texture
+ cache, return the values of their scalar versions, and times both.
+ Usage: noise_benchmark [--points=n] [--seconds=s]
+ @return 1 when the SIMD results differ from the scalar ones
+ */
+int main(int argc, const char *argv[]) {
+  Options options = parse_options(argc, argv);
+  int count = options.get("points", 1 << 16);
+  double seconds = options.get("seconds", 0.25f);
+
+  minstd_rand rng(20220115u);
+  uniform_real_distribution<float> uniform(-50.0f, 50.0f);
+  vector<float> x(count), y(count), z(count);
+  vector<glm::vec2> uv(count);
+  for (int i = 0; i < count; i++) {
+    x[i] = uniform(rng);
+    y[i] = uniform(rng);
+    z[i] = uniform(rng);
+    uv[i] = glm::vec2(x[i], y[i]);
+  }
+
+  vector<float> scalar(count), batch(count);
+  vector<glm::vec3> texture(count), row(count);
+  for (int i = 0; i < count; i++) {
+    scalar[i] = PerlinEngine::noise(x[i], y[i], z[i]);
+    texture[i] = perlinNoise(uv[i]);
+  }
+  PerlinEngine::noise(x.data(), y.data(), z.data(), batch.data(), count);
+  perlinNoiseRow(uv.data(), row.data(), count);
+  float noise_error = 0.0f, texture_error = 0.0f;
+  for (int i = 0; i < count; i++) {
+    noise_error = max(noise_error, abs(scalar[i] - batch[i]));
+    texture_error = max(texture_error, glm::length(texture[i] - row[i]));
+  }
+
+#if defined(__AVX2__)
+  const char *isa = "AVX2, 8 points per call";
+#elif defined(__SSE2__)
+  const char *isa = "SSE2, 4 points per call";
+#else
+  const char *isa = "scalar only";
+#endif
+  cout << "Batched noise: " << isa << endl;
+  cout << "Largest difference from the scalar version: noise " << noise_error << ", texture " << texture_error << endl;
+
+  double scalar_ns = time_per_point([&]() {
+    for (int i = 0; i < count; i++)
+      scalar[i] = PerlinEngine::noise(x[i], y[i], z[i]);
+  }, count, seconds);
+  double batch_ns = time_per_point([&]() {
+    PerlinEngine::noise(x.data(), y.data(), z.data(), batch.data(), count);
+  }, count, seconds);
+  double texture_ns = time_per_point([&]() {
+    for (int i = 0; i < count; i++)
+      texture[i] = perlinNoise(uv[i]);
+  }, count, seconds);
+  double row_ns = time_per_point([&]() {
+    perlinNoiseRow(uv.data(), row.data(), count);
+  }, count, seconds);
+  cout << left << setw(22) << "kernel" << right << setw(12) << "ns/point" << endl << fixed << setprecision(3);
+  cout << left << setw(22) << "noise scalar" << right << setw(12) << scalar_ns << endl;
+  cout << left << setw(22) << "noise batch" << right << setw(12) << batch_ns << endl;
+  cout << left << setw(22) << "perlinNoise" << right << setw(12) << texture_ns << endl;
+  cout << left << setw(22) << "perlinNoiseRow" << right << setw(12) << row_ns << endl;
+  return noise_error == 0.0f && texture_error == 0.0f ? 0 : 1;
+}
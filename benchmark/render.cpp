@@ -0,0 +1,170 @@
+//
+// Created by Volodymyr Karpenko on 10.01.22.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Options.h"
+
+using namespace std;
+
+/** One canonical scene: the --scene of the renderer and the meshes it loads*/
+struct Scene {
+  string name;
+  string scene;
+  vector<string> meshes;
+};
+
+/** Result of one render of a scene*/
+struct Run {
+  string scene;
+  int threads;
+  double wall_seconds; ///< Time of the whole process, loading and writing included
+  double render_seconds; ///< Time of the render phase as reported by the renderer, 0 without its statistics
+  double rays; ///< Camera, shadow and secondary rays traced, 0 without the statistics of the renderer
+  long peak_rss_kb; ///< Largest resident set of the process
+  double efficiency; ///< Speedup over the single-threaded render divided by the number of threads
+};
+
+/** Value of a numeric field of the JSON written by the renderer, 0 when it is missing*/
+double json_number(const string &json, const string &key) {
+  size_t at = json.find("\"" + key + "\":");
+  if (at == string::npos)
+    return 0.0;
+  return strtod(json.c_str() + at + key.size() + 3, nullptr);
+}
+
+/**
+ Runs the renderer once and waits for it
+ @param renderer Path of the renderer executable
+ @param arguments Arguments of the renderer
+ @param wall_seconds Wall-clock time of the process
+ @param peak_rss_kb Largest resident set of the process in kilobytes
+ @return Whether the renderer exited successfully
+ */
+bool run_renderer(const string &renderer, const vector<string> &arguments, double &wall_seconds, long &peak_rss_kb) {
+  vector<char *> argv;
+  argv.push_back(const_cast<char *>(renderer.c_str()));
+  for (auto &argument: arguments)
+    argv.push_back(const_cast<char *>(argument.c_str()));
+  argv.push_back(nullptr);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  pid_t child = fork();
+  if (child == 0) {
+    // the renderer talks a lot, only the table of the benchmark is wanted
+    freopen("/dev/null", "w", stdout);
+    execv(renderer.c_str(), argv.data());
+    _exit(127);
+  }
+  if (child < 0)
+    return false;
+  int status = 0;
+  rusage usage{};
+  wait4(child, &status, 0, &usage);
+  wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  peak_rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ End-to-end benchmark of the renderer. Every canonical scene is rendered at a fixed resolution with 1, 2, 4, ...
+ up to the maximal number of threads; the renderer traces four camera rays per pixel. Reports wall time, Mrays/s,
+ parallel efficiency against the single-threaded render and peak RSS.
+ Usage: render_benchmark [--renderer=path] [--mesh=large.obj] [--model=model.obj] [--width=w] [--height=h]
+                         [--max-threads=n] [--json=path]
+ */
+int main(int argc, const char *argv[]) {
+  Options options = parse_options(argc, argv);
+  string self = argv[0];
+  string directory = self.find('/') == string::npos ? "." : self.substr(0, self.rfind('/'));
+  string renderer = options.get("renderer", directory + "/USI_Rendering_Competition");
+  int width = options.get("width", 256);
+  int height = options.get("height", 192);
+  int max_threads = options.get("max-threads", (int) thread::hardware_concurrency());
+  string stats_path = "/tmp/render_benchmark_" + to_string(getpid()) + ".json";
+
+  vector<Scene> scenes;
+  vector<string> model;
+  if (options.has("model"))
+    model.push_back(options.get("model", ""));
+  scenes.push_back({"competition", "competition", model});
+  if (options.has("mesh"))
+    scenes.push_back({"large-mesh", "", {options.get("mesh", "")}});
+  scenes.push_back({"spheres", "spheres", {}});
+  scenes.push_back({"glass", "glass", {}});
+
+  vector<int> thread_counts;
+  for (int t = 1; t < max_threads; t *= 2)
+    thread_counts.push_back(t);
+  thread_counts.push_back(max(1, max_threads));
+
+  vector<Run> runs;
+  cout << "Resolution " << width << "x" << height << ", 4 camera rays per pixel" << endl;
+  cout << left << setw(13) << "scene" << right << setw(8) << "threads" << setw(10) << "wall s" << setw(10)
+       << "render s" << setw(10) << "Mrays/s" << setw(12) << "efficiency" << setw(12) << "peak MB" << endl;
+  for (auto &scene: scenes) {
+    double single = 0.0;
+    for (int threads: thread_counts) {
+      vector<string> arguments = scene.meshes;
+      if (!scene.scene.empty())
+        arguments.push_back("--scene=" + scene.scene);
+      arguments.push_back("--layout=bvh");
+      arguments.push_back("--threads=" + to_string(threads));
+      arguments.push_back("--width=" + to_string(width));
+      arguments.push_back("--height=" + to_string(height));
+      arguments.push_back("--output=/dev/null");
+      arguments.push_back("--stats-json=" + stats_path);
+      remove(stats_path.c_str());
+
+      Run run{scene.name, threads, 0.0, 0.0, 0.0, 0, 1.0};
+      if (!run_renderer(renderer, arguments, run.wall_seconds, run.peak_rss_kb)) {
+        cerr << "The renderer " << renderer << " failed on " << scene.name << endl;
+        return 1;
+      }
+      ifstream file(stats_path);
+      stringstream json;
+      json << file.rdbuf();
+      run.render_seconds = json_number(json.str(), "render");
+      for (const char *counter: {"camera_rays", "shadow_rays", "reflection_rays", "refraction_rays"})
+        run.rays += json_number(json.str(), counter);
+
+      // without the statistics of the renderer the wall time is all there is
+      double seconds = run.render_seconds > 0 ? run.render_seconds : run.wall_seconds;
+      if (threads == 1)
+        single = seconds;
+      run.efficiency = single / (seconds * threads);
+      runs.push_back(run);
+      cout << left << setw(13) << scene.name << right << setw(8) << threads << fixed << setprecision(3) << setw(10)
+           << run.wall_seconds << setw(10) << run.render_seconds << setw(10) << run.rays / seconds * 1e-6
+           << setw(12) << run.efficiency << setw(12) << setprecision(1) << (double) run.peak_rss_kb / 1024.0 << endl;
+    }
+  }
+  remove(stats_path.c_str());
+
+  if (options.has("json")) {
+    ofstream json(options.get("json", "render_benchmark.json"));
+    json << "{\n  \"width\": " << width << ",\n  \"height\": " << height << ",\n  \"runs\": [\n";
+    for (size_t i = 0; i < runs.size(); i++) {
+      const Run &run = runs[i];
+      double seconds = run.render_seconds > 0 ? run.render_seconds : run.wall_seconds;
+      json << "    {\"scene\": \"" << run.scene << "\", \"threads\": " << run.threads << ", \"wall_seconds\": "
+           << run.wall_seconds << ", \"render_seconds\": " << run.render_seconds << ", \"rays\": " << run.rays
+           << ", \"mrays_per_s\": " << run.rays / seconds * 1e-6 << ", \"parallel_efficiency\": " << run.efficiency
+           << ", \"peak_rss_kb\": " << run.peak_rss_kb << "}"
+           << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}" << endl;
+  }
+  return 0;
+}
@@ -6,9 +6,19 @@
 #include <fstream>
 #include <cmath>
 #include <ctime>
+#include <iomanip>
 #include <chrono>
 #include <vector>
 #include <thread>
+#include <numeric>
+#include <algorithm>
+#include <random>
+#include <array>
+#include <utility>
+#include <atomic>
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
 #include "glm/glm.hpp"
 #include "glm/gtx/transform.hpp"
 #include "thread-pool/thread_pool.hpp"
@@ -20,134 +30,720 @@
 #include "Image.h"
 #include "Ray.h"
 #include "Light.h"
+#include "Options.h"
+#include "TextureCache.h"
+#include "LightTree.h"
+#include "Stats.h"
+#include "CostMap.h"
+#include "ImageCompare.h"
+#include "Trace.h"
+#include "Perf.h"
+#include "FrameBuffer.h"
+#include "Denoiser.h"
 
 using std::chrono::system_clock;
+using std::chrono::steady_clock;
 
 using namespace std;
 
 vector<Object *> objects; ///< A list of all objects in the scene
 
 
-/** Function for computing color of an object according to the Phong Model
+/**
+ Terms of the Phong model that only depend on the hit, evaluated once before the loop over the lights
+ */
+struct SurfacePoint {
+  glm::vec3 point; ///< Shaded point
+  glm::vec3 normal; ///< Normal at the point
+  glm::vec3 view_direction; ///< Normalized direction from the point to the viewer/camera
+  glm::vec3 diffuse_color; ///< Diffuse color of the material or of its texture
+  glm::vec3 shading; ///< With TEXTURE_SHADING, the texture value replacing the normal in N.L
+  glm::vec3 specular; ///< Specular color of the material
+  float shininess; ///< Shininess of the material
+};
+
+/**
+ Per-thread results of the loop over the light samples, one entry per sample
+ */
+struct LightScratch {
+  vector<float> dx, dy, dz; ///< Normalized directions from the point to the samples
+  vector<float> distance; ///< Distances from the point to the samples
+  vector<float> r, g, b; ///< Unoccluded contributions of the samples
+  vector<char> visible; ///< Visibility of the samples, when traced by the kernel
+
+  void resize(int n) {
+    dx.resize(n);
+    dy.resize(n);
+    dz.resize(n);
+    distance.resize(n);
+    r.resize(n);
+    g.resize(n);
+    b.resize(n);
+    visible.resize(n);
+  }
+};
+
+thread_local LightScratch light_scratch; ///< Scratch space of the light loop of the thread
+
+/** Function preparing the terms of the Phong model that are the same for every light
+ @tparam features Shading features of the material, see MaterialFeature
  @param point A point belonging to the object for which the color is computer
  @param normal A normal vector the the point
  @param uv Texture coordinates
  @param view_direction A normalized direction from the point to the viewer/camera
  @param material A material structure representing the material of the object
+ @param footprint Width in uv units covered by the point, for filtering baked textures
 */
-glm::vec3 PhongModel(glm::vec3 point, glm::vec3 normal, glm::vec2 uv, glm::vec3 view_direction, Material material) {
+template<unsigned features>
+SurfacePoint prepare_surface(glm::vec3 point, glm::vec3 normal, glm::vec2 uv, glm::vec3 view_direction,
+                             const Material &material, float footprint) {
+  SurfacePoint surface{point, normal, view_direction, material.diffuse, glm::vec3(0.0f), material.specular,
+                       material.shininess};
+  if constexpr ((features & TEXTURED) != 0) {
+    surface.diffuse_color = texture_lookup(material.texture, uv, footprint);
+    surface.shading = surface.diffuse_color;
+  }
+  return surface;
+}
 
-  glm::vec3 color(0.0);
-  for (auto &light_g: soft_lights) {
-    glm::vec3 local_color(0.0);
-    for (auto &light: light_g) {
-      glm::vec3 light_direction = glm::normalize(light->position - point);
-      glm::vec3 reflected_direction = glm::reflect(-light_direction, normal);
+/** Function computing the contribution of every light sample to a point according to the Phong Model, ignoring occlusion.
+ The loop runs over the arrays of the samples, four samples at a time with SSE, and only computes the direction,
+ the falloff and the BRDF. Every lane computes exactly what the scalar loop computes for the remaining samples
+ @tparam features Shading features of the material, see MaterialFeature
+ @param surface Terms of the point that do not depend on the light
+ @param lights_soa Light samples of the point
+ @param out Directions, distances and contributions of the samples
+*/
+template<unsigned features>
+void evaluate_lights(const SurfacePoint &surface, const LightArrays &lights_soa, LightScratch &out) {
+  int n = lights_soa.size();
+  out.resize(n);
+  const float *lx = lights_soa.x.data(), *ly = lights_soa.y.data(), *lz = lights_soa.z.data();
+  const float *lr = lights_soa.r.data(), *lg = lights_soa.g.data(), *lb = lights_soa.b.data();
+  float *dx = out.dx.data(), *dy = out.dy.data(), *dz = out.dz.data(), *distance = out.distance.data();
+  float *cr = out.r.data(), *cg = out.g.data(), *cb = out.b.data();
+  const glm::vec3 p = surface.point;
+  const glm::vec3 normal = surface.normal;
+  const glm::vec3 view = surface.view_direction;
+  const glm::vec3 diffuse_color = surface.diffuse_color;
+  const glm::vec3 shading = surface.shading;
+  const glm::vec3 specular_color = surface.specular;
+  const float shininess = surface.shininess;
 
-      float NdotL = glm::clamp(glm::dot(normal, light_direction), 0.0f, 1.0f);
-      float VdotR = glm::clamp(glm::dot(view_direction, reflected_direction), 0.0f, 1.0f);
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_sub_ps(_mm_loadu_ps(lx + i), _mm_set1_ps(p.x));
+    __m128 y = _mm_sub_ps(_mm_loadu_ps(ly + i), _mm_set1_ps(p.y));
+    __m128 z = _mm_sub_ps(_mm_loadu_ps(lz + i), _mm_set1_ps(p.z));
+    __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+    __m128 inverse = _mm_div_ps(one, length);
+    x = _mm_mul_ps(x, inverse);
+    y = _mm_mul_ps(y, inverse);
+    z = _mm_mul_ps(z, inverse);
+    _mm_storeu_ps(dx + i, x);
+    _mm_storeu_ps(dy + i, y);
+    _mm_storeu_ps(dz + i, z);
+    _mm_storeu_ps(distance + i, length);
 
-      glm::vec3 diffuse_color = material.diffuse;
-      if (material.texture) diffuse_color = material.texture(uv);
-      if (material.texture == perlinNoise) {
-        NdotL = glm::dot(material.texture(uv), light_direction);
-      }
+    // min(max(v, 0), 1) with the operand order of std::min and std::max
+    __m128 NdotL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(normal.x), x), _mm_mul_ps(_mm_set1_ps(normal.y), y)),
+                              _mm_mul_ps(_mm_set1_ps(normal.z), z));
+    NdotL = _mm_min_ps(one, _mm_max_ps(zero, NdotL));
+    if constexpr ((features & TEXTURE_SHADING) != 0) {
+      NdotL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(shading.x), x), _mm_mul_ps(_mm_set1_ps(shading.y), y)),
+                         _mm_mul_ps(_mm_set1_ps(shading.z), z));
+    }
+    __m128 red = _mm_mul_ps(_mm_set1_ps(diffuse_color.x), NdotL);
+    __m128 green = _mm_mul_ps(_mm_set1_ps(diffuse_color.y), NdotL);
+    __m128 blue = _mm_mul_ps(_mm_set1_ps(diffuse_color.z), NdotL);
+    if constexpr ((features & SPECULAR) != 0) {
+      __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+      __m128 ix = _mm_xor_ps(x, sign), iy = _mm_xor_ps(y, sign), iz = _mm_xor_ps(z, sign);
+      __m128 NdotI = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, ix), _mm_mul_ps(ny, iy)), _mm_mul_ps(nz, iz));
+      __m128 two = _mm_set1_ps(2.0f);
+      __m128 rx = _mm_sub_ps(ix, _mm_mul_ps(_mm_mul_ps(nx, NdotI), two));
+      __m128 ry = _mm_sub_ps(iy, _mm_mul_ps(_mm_mul_ps(ny, NdotI), two));
+      __m128 rz = _mm_sub_ps(iz, _mm_mul_ps(_mm_mul_ps(nz, NdotI), two));
+      __m128 VdotR = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(view.x), rx), _mm_mul_ps(_mm_set1_ps(view.y), ry)),
+                                _mm_mul_ps(_mm_set1_ps(view.z), rz));
+      alignas(16) float highlight[4];
+      _mm_store_ps(highlight, _mm_min_ps(one, _mm_max_ps(zero, VdotR)));
+      for (float &h: highlight)
+        h = pow(h, shininess);
+      __m128 highlights = _mm_load_ps(highlight);
+      red = _mm_add_ps(red, _mm_mul_ps(_mm_set1_ps(specular_color.x), highlights));
+      green = _mm_add_ps(green, _mm_mul_ps(_mm_set1_ps(specular_color.y), highlights));
+      blue = _mm_add_ps(blue, _mm_mul_ps(_mm_set1_ps(specular_color.z), highlights));
+    }
 
-      glm::vec3 diffuse = diffuse_color * glm::vec3(NdotL);
-      glm::vec3 specular = material.specular * glm::vec3(pow(VdotR, material.shininess));
+    // distance to the light
+    __m128 r = _mm_max_ps(_mm_set1_ps(0.1f), length);
+    _mm_storeu_ps(cr + i, _mm_div_ps(_mm_div_ps(_mm_mul_ps(_mm_loadu_ps(lr + i), red), r), r));
+    _mm_storeu_ps(cg + i, _mm_div_ps(_mm_div_ps(_mm_mul_ps(_mm_loadu_ps(lg + i), green), r), r));
+    _mm_storeu_ps(cb + i, _mm_div_ps(_mm_div_ps(_mm_mul_ps(_mm_loadu_ps(lb + i), blue), r), r));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = lx[i] - p.x;
+    float y = ly[i] - p.y;
+    float z = lz[i] - p.z;
+    float length = sqrt(x * x + y * y + z * z);
+    float inverse = 1.0f / length;
+    x *= inverse;
+    y *= inverse;
+    z *= inverse;
+    dx[i] = x;
+    dy[i] = y;
+    dz[i] = z;
+    distance[i] = length;
 
+    float NdotL = min(max(normal.x * x + normal.y * y + normal.z * z, 0.0f), 1.0f);
+    if constexpr ((features & TEXTURE_SHADING) != 0) {
+      NdotL = shading.x * x + shading.y * y + shading.z * z;
+    }
+    float red = diffuse_color.x * NdotL;
+    float green = diffuse_color.y * NdotL;
+    float blue = diffuse_color.z * NdotL;
+    if constexpr ((features & SPECULAR) != 0) {
+      // reflect(-L, N)
+      float NdotI = normal.x * -x + normal.y * -y + normal.z * -z;
+      float rx = -x - normal.x * NdotI * 2.0f;
+      float ry = -y - normal.y * NdotI * 2.0f;
+      float rz = -z - normal.z * NdotI * 2.0f;
+      float VdotR = min(max(view.x * rx + view.y * ry + view.z * rz, 0.0f), 1.0f);
+      float highlight = pow(VdotR, shininess);
+      red = red + specular_color.x * highlight;
+      green = green + specular_color.y * highlight;
+      blue = blue + specular_color.z * highlight;
+    }
 
-      // distance to the light
-      float r = glm::distance(point, light->position);
-      r = max(r, 0.1f);
+    // distance to the light
+    float r = max(length, 0.1f);
+    cr[i] = lr[i] * red / r / r;
+    cg[i] = lg[i] * green / r / r;
+    cb[i] = lb[i] * blue / r / r;
+  }
+}
 
-      float sj = 1.f;
-      Ray ray = Ray(point, light_direction);
-      for (auto &object: objects) {
-        Hit hit = object->intersect(ray);
-        if (hit.hit && hit.distance < glm::distance(light->position, point) &&
-            hit.distance > 0.003) {
-          sj = 0.f;
-          break;
-        }
+/**
+ Per-thread cache of the object that last blocked a shadow ray towards every area light. Shadow rays of a tile
+ towards the same light are mostly blocked by the same object, which is tested before the rest of the scene
+ */
+struct OccluderCache {
+  vector<Object *> last; ///< Last occluder of every light of area_lights, null when none is known
+  size_t hits = 0; ///< Shadow rays blocked by the cached occluder
+  size_t misses = 0; ///< Shadow rays tested against the whole scene
+};
+
+thread_local OccluderCache occluder_cache;
+bool cache_occluders = false; ///< Whether occluded checks the last occluder of the light first
+atomic<size_t> occluder_hits{0}; ///< Hits of the occluder caches of finished tasks
+atomic<size_t> occluder_misses{0}; ///< Misses of the occluder caches of finished tasks
+
+/** Adds the statistics of the occluder cache of the thread to the totals*/
+void flush_occluder_stats() {
+  occluder_hits += occluder_cache.hits;
+  occluder_misses += occluder_cache.misses;
+  occluder_cache.hits = 0;
+  occluder_cache.misses = 0;
+}
+
+/** Function checking whether an object lies on the shadow ray between a point and a light
+ @param ray Shadow ray starting at the point
+ @param light_distance Distance from the point to the light
+ @param light Index of the light in area_lights, for the occluder cache; -1 when unknown
+*/
+bool occluded(Ray ray, float light_distance, int light = -1) {
+  STAT_INC(SHADOW_RAYS);
+  auto blocks = [&](Object *object) {
+    Hit hit = object->queryHit(ray);
+    return hit.hit && hit.distance < light_distance &&
+        hit.distance > 0.003;
+  };
+  if (!cache_occluders || light < 0) {
+    for (auto &object: objects) {
+      if (blocks(object))
+        return true;
+    }
+    return false;
+  }
+
+  OccluderCache &cache = occluder_cache;
+  if ((int) cache.last.size() <= light)
+    cache.last.resize(area_lights.size(), nullptr);
+  Object *last = cache.last[light];
+  if (last && blocks(last)) {
+    cache.hits++;
+    return true;
+  }
+  cache.misses++;
+  for (auto &object: objects) {
+    if (object != last && blocks(object)) {
+      cache.last[light] = object;
+      return true;
+    }
+  }
+  return false;
+}
+
+int shadow_probes = 0; ///< Samples of a light group traced before the others, every sample is traced when 0
+float coherence_radius = 0.05f; ///< Distance within which a point trusts the shadow state of the previous point
+
+/** Shadow state of a light group at a shading point*/
+enum ShadowState : char {
+  UNKNOWN_SHADOW, FULLY_LIT, FULLY_OCCLUDED, PENUMBRA
+};
+
+/**
+ Shadow states of the light groups at the last shading point of the thread. Consecutive points of a thread are
+ mostly neighbouring pixels of a tile, so a point close to the previous one that was fully lit or fully occluded
+ by a group only checks that state with a single probe.
+ */
+struct ShadowCoherence {
+  vector<glm::vec3> point; ///< Last shading point of every group
+  vector<char> state; ///< ShadowState of every group at that point
+};
+
+thread_local ShadowCoherence shadow_coherence;
+
+/** Index in its group of probe k of the probes of a group of n samples, spread from the first sample to the last*/
+int probe_index(int k, int probes, int n) {
+  if (probes == 1)
+    return n / 2;
+  return (int) ((long) k * (n - 1) * 2 + probes - 1) / (2 * (probes - 1));
+}
+
+/**
+ Traces the visibility of the light samples of a point adaptively: a few probes spread over every group are traced
+ first, and the remaining samples of a group only when its probes disagree, that is in its penumbra.
+ Otherwise the probes decide the visibility of the whole group
+ @param lights Light samples of the point
+ @param point The shading point
+ @param visible Visibility of every sample
+ @param trace Function tracing the shadow ray of a sample towards a light and returning whether the sample is visible
+ */
+template<class Trace>
+void adaptive_visibility(const LightArrays &lights, glm::vec3 point, char *visible, Trace trace) {
+  ShadowCoherence &cache = shadow_coherence;
+  int groups = (int) lights.group_end.size();
+  cache.point.resize(groups, glm::vec3(INFINITY));
+  cache.state.resize(groups, UNKNOWN_SHADOW);
+  int first = 0;
+  for (int g = 0; g < groups; g++) {
+    int end = lights.group_end[g];
+    int n = end - first;
+    int probes = min(shadow_probes, n);
+    char cached = cache.state[g];
+    bool coherent = (cached == FULLY_LIT || cached == FULLY_OCCLUDED) &&
+        glm::distance(cache.point[g], point) < coherence_radius;
+    if (coherent && n > 1)
+      probes = 1;
+
+    fill(visible + first, visible + end, 2);
+    int lit = 0;
+    for (int k = 0; k < probes; k++) {
+      int i = first + probe_index(k, probes, n);
+      visible[i] = trace(i, lights.group_light[g]);
+      lit += visible[i];
+    }
+    char state = lit == probes ? FULLY_LIT : (lit == 0 ? FULLY_OCCLUDED : PENUMBRA);
+    if (coherent && probes == 1 && state != cached)
+      state = PENUMBRA;
+    if (state == PENUMBRA || probes == n) {
+      lit = 0;
+      for (int i = first; i < end; i++) {
+        if (visible[i] == 2)
+          visible[i] = trace(i, lights.group_light[g]);
+        lit += visible[i];
       }
-      if (sj != 0.f)
-        local_color += light->color * (diffuse + specular) / r / r;
+      state = lit == n ? FULLY_LIT : (lit == 0 ? FULLY_OCCLUDED : PENUMBRA);
+    } else {
+      fill(visible + first, visible + end, state == FULLY_LIT);
+    }
+    cache.point[g] = point;
+    cache.state[g] = state;
+    first = end;
+  }
+}
+
+/** Function for computing color of an object according to the Phong Model, compiled for one set of material features
+ @tparam features Shading features of the material, see MaterialFeature
+ @param point A point belonging to the object for which the color is computer
+ @param normal A normal vector the the point
+ @param uv Texture coordinates
+ @param view_direction A normalized direction from the point to the viewer/camera
+ @param material A material structure representing the material of the object
+ @param footprint Width in uv units covered by the point, for filtering baked textures
+ @param lights Light samples of the point, one group per area light
+ @param visibility Whether each light sample is visible from the point, in the order of lights; traced when not given
+*/
+template<unsigned features>
+glm::vec3 phong_kernel(glm::vec3 point, glm::vec3 normal, glm::vec2 uv, glm::vec3 view_direction,
+                       const Material &material, float footprint, const LightArrays &lights, const char *visibility) {
+  SurfacePoint surface = prepare_surface<features>(point, normal, uv, view_direction, material, footprint);
+  LightScratch &scratch = light_scratch;
+  evaluate_lights<features>(surface, lights, scratch);
+  if (!visibility) {
+    auto trace = [&](int i, int light) {
+      return (char) !occluded(Ray(point, glm::vec3(scratch.dx[i], scratch.dy[i], scratch.dz[i])), scratch.distance[i],
+                              light);
+    };
+    if (shadow_probes > 0) {
+      adaptive_visibility(lights, point, scratch.visible.data(), trace);
+    } else {
+      int i = 0;
+      for (int g = 0; g < (int) lights.group_end.size(); g++)
+        for (; i < lights.group_end[g]; i++)
+          scratch.visible[i] = trace(i, lights.group_light[g]);
+    }
+    visibility = scratch.visible.data();
+  }
+
+  glm::vec3 color(0.0);
+  int first = 0;
+  for (int end: lights.group_end) {
+    glm::vec3 local_color(0.0);
+    for (int i = first; i < end; i++) {
+      if (visibility[i])
+        local_color += glm::vec3(scratch.r[i], scratch.g[i], scratch.b[i]);
     }
-    color += local_color / (float) light_g.size();
+    color += local_color / (float) (end - first);
+    first = end;
   }
   color += ambient_light * material.ambient;
   color = glm::clamp(color, glm::vec3(0.0), glm::vec3(1.0));
   return color;
 }
 
-/**
- Functions that computes a color along the ray
- @param ray Ray that should be traced through the scene
- @return Color at the intersection point
- */
-glm::vec3 trace_ray(Ray ray, int depth, bool outside) {
+typedef glm::vec3 (*PhongKernel)(glm::vec3, glm::vec3, glm::vec2, glm::vec3, const Material &, float,
+                                  const LightArrays &, const char *);
+
+template<size_t... features>
+constexpr array<PhongKernel, sizeof...(features)> phong_kernels(index_sequence<features...>) {
+  return {&phong_kernel<features>...};
+}
+
+/** One Phong kernel per combination of the shading features, indexed by the features*/
+constexpr array<PhongKernel, SHADING_FEATURES + 1> phong_kernel_table =
+    phong_kernels(make_index_sequence<SHADING_FEATURES + 1>());
+
+/** Function for computing color of an object according to the Phong Model, with the kernel compiled for its material
+ @param point A point belonging to the object for which the color is computer
+ @param normal A normal vector the the point
+ @param uv Texture coordinates
+ @param view_direction A normalized direction from the point to the viewer/camera
+ @param material Index of the material of the object in the material table
+ @param footprint Width in uv units covered by the point, for filtering baked textures
+ @param lights Light samples of the point; drawn by sample_lights when not given
+ @param visibility Whether each light sample is visible from the point, in the order of lights; traced when not given
+*/
+glm::vec3 PhongModel(glm::vec3 point, glm::vec3 normal, glm::vec2 uv, glm::vec3 view_direction, MaterialId material,
+                     float footprint = 0.0f, const LightArrays *lights = nullptr, const char *visibility = nullptr) {
+  STAT_INC(SHADING_CALLS);
+  PhongKernel kernel = phong_kernel_table[material_flags[material] & SHADING_FEATURES];
+  if (!lights) {
+    thread_local LightArrays samples;
+    sample_lights(samples, point);
+    lights = &samples;
+  }
+  return kernel(point, normal, uv, view_direction, materials[material], footprint, *lights, visibility);
+}
+
+glm::vec3 trace_ray(Ray ray, int depth, bool outside);
 
+/** What the frame buffer keeps of a camera ray*/
+struct CameraSample {
+  Hit hit; ///< Closest hit of the ray
+  glm::vec3 direct; ///< Direct light at the hit, before tone mapping
+  glm::vec3 color; ///< Light along the ray with the secondary rays, before tone mapping
+};
+
+/** Function finding the closest intersection of a ray with the objects of the scene*/
+Hit find_closest_hit(const Ray &ray) {
   Hit closest_hit{};
   closest_hit.hit = false;
   closest_hit.distance = INFINITY;
 
   for (auto &object: objects) {
-    Hit hit = object->intersect(ray);
+    Hit hit = object->queryHit(ray);
     if (hit.hit && hit.distance < closest_hit.distance) closest_hit = hit;
   }
+  if (closest_hit.hit)
+    closest_hit.object->computeSurface(ray, closest_hit);
+  return closest_hit;
+}
 
-  glm::vec3 color(0.0);
-  glm::vec3 reflect_color(0.0f);
-  glm::vec3 refract_color(0.0f);
-
-  if (depth > 0 && closest_hit.hit) {
-
-    if (closest_hit.object->getMaterial().refract) {
-      float Fr;
-      float Ft;
-      float delta1 = 1.0f;
-      float delta2 = closest_hit.object->getMaterial().refractiveIndex;
-
-      float beta = 1.0f / closest_hit.object->getMaterial().refractiveIndex;
-      glm::vec3 refraction_direction = glm::normalize(glm::refract(ray.direction, closest_hit.normal, beta));
-      if (!outside) {
-        beta = 1.0f / beta;
-        refraction_direction = glm::normalize(glm::refract(ray.direction, -closest_hit.normal, beta));
-        delta1 = closest_hit.object->getMaterial().refractiveIndex;
-        delta2 = 1.0f;
-      }
-      float cos_theta1 = glm::dot(-ray.direction, closest_hit.normal);
-      float cos_theta2 = glm::dot(refraction_direction, -closest_hit.normal);
-
-      float part1 = (delta1 * cos_theta1 - delta2 * cos_theta2) / (delta1 * cos_theta1 + delta2 * cos_theta2);
-      float part2 = (delta1 * cos_theta2 - delta2 * cos_theta1) / (delta1 * cos_theta2 + delta2 * cos_theta1);
-      Fr = (float) ((1.0f / 2.0f) * (glm::pow(part1, 2) + glm::pow(part2, 2)));
-      Ft = 1.0f - Fr;
-
-      Ray refractRay(closest_hit.intersection, refraction_direction);
-      refract_color = glm::clamp(
-          Ft * trace_ray(refractRay, depth - 1, !outside),
-          glm::vec3(0.0f), glm::vec3(1.0f));
+/**
+ Function computing the direction of the refracted ray at a hit and the fraction of light it carries
+ @param ray Ray that hit a refractive object
+ @param closest_hit Intersection of the ray with the refractive object
+ @param outside Whether the ray travels outside of the object
+ @param refraction_direction Direction of the refracted ray
+ @return Fresnel transmittance Ft
+ */
+float refraction(const Ray &ray, const Hit &closest_hit, bool outside, glm::vec3 &refraction_direction) {
+  float Fr;
+  float Ft;
+  const Material &material = closest_hit.object->getMaterial();
+  float delta1 = 1.0f;
+  float delta2 = material.refractiveIndex;
+
+  float beta = 1.0f / material.refractiveIndex;
+  refraction_direction = glm::normalize(glm::refract(ray.direction, closest_hit.normal, beta));
+  if (!outside) {
+    beta = 1.0f / beta;
+    refraction_direction = glm::normalize(glm::refract(ray.direction, -closest_hit.normal, beta));
+    delta1 = material.refractiveIndex;
+    delta2 = 1.0f;
+  }
+  float cos_theta1 = glm::dot(-ray.direction, closest_hit.normal);
+  float cos_theta2 = glm::dot(refraction_direction, -closest_hit.normal);
+
+  float part1 = (delta1 * cos_theta1 - delta2 * cos_theta2) / (delta1 * cos_theta1 + delta2 * cos_theta2);
+  float part2 = (delta1 * cos_theta2 - delta2 * cos_theta1) / (delta1 * cos_theta2 + delta2 * cos_theta1);
+  Fr = (float) ((1.0f / 2.0f) * (glm::pow(part1, 2) + glm::pow(part2, 2)));
+  Ft = 1.0f - Fr;
+  return Ft;
+}
+
+int max_depth = 3; ///< Number of surfaces a camera ray and its secondary rays may hit
+float contribution_cutoff = 0.0f; ///< Secondary rays carrying a lower fraction of light to the camera are not traced
+float roulette_threshold = 0.0f; ///< Below this throughput secondary rays are kept by Russian roulette, 0 disables it
+
+/**
+ A ray of the tree of secondary rays spawned by a camera ray, with what is needed to combine its color into its parent
+ */
+struct PathVertex {
+  Ray ray;
+  Hit hit;
+  int depth; ///< Remaining depth, as in trace_ray
+  bool outside; ///< Whether the ray travels outside of refractive objects
+  float weight; ///< Fresnel transmittance or reflectivity scaling the color of this ray in its parent
+  float throughput; ///< Product of the weights from the camera down to this ray
+  float cone_width; ///< Width of the cone of the pixel around this ray at its origin
+  int reflect_child; ///< Vertex of the reflected ray, -1 if there is none
+  int refract_child; ///< Vertex of the refracted ray, -1 if there is none
+  glm::vec3 color; ///< Direct color at the hit, then the color including the secondary rays
+  uint32_t seed; ///< Seed of the random numbers shading this ray in a deterministic render
+};
+
+float pixel_spread = 0.0f; ///< Angle covered by a pixel, the rate at which the cone of a pixel widens
+
+/** Width of the cone of the pixel at the hit of a vertex, ignoring the curvature of the surfaces*/
+float footprint(const PathVertex &vertex) {
+  return vertex.cone_width + vertex.hit.distance * pixel_spread;
+}
+
+/** Width of the cone of the pixel at the hit of a vertex in the texture coordinates of the surface hit*/
+float uv_footprint(const PathVertex &vertex) {
+  return footprint(vertex) * vertex.hit.object->uvScale();
+}
+
+thread_local minstd_rand roulette_rng(random_device{}()); ///< Random numbers of the Russian roulette, one stream per thread
+
+bool deterministic = false; ///< Whether every ray reseeds its random numbers, so the threads do not matter
+uint32_t render_seed = 1; ///< Seed of the deterministic render
+
+/** Mixes the bits of a seed so that close seeds start unrelated streams*/
+uint32_t hash_seed(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+/** Seed of the shading of camera ray m of a pixel*/
+uint32_t camera_seed(int i, int j, int m) {
+  return hash_seed(render_seed * 0x9E3779B9u ^ (uint32_t) i * 0x85EBCA6Bu ^ (uint32_t) j * 0xC2B2AE35u
+                       ^ (uint32_t) (m + 1) * 0x27D4EB2Fu);
+}
+
+/** Seed of the shading of the reflected (branch 0) or refracted (branch 1) ray of a ray*/
+uint32_t child_seed(uint32_t seed, int branch) {
+  return hash_seed(seed * 2u + (uint32_t) branch + 1u);
+}
+
+/**
+ Reseeds the light samples and the roulette of the thread for a ray of a deterministic render, so that the ray gets
+ the same random numbers whichever thread or render mode shades it and in whatever order
+ @param seed Seed of the ray, see PathVertex
+ */
+void seed_shading(uint32_t seed) {
+  light_rng.seed(seed ^ 0x68E31DA4u);
+  roulette_rng.seed(seed ^ 0xB5297A4Du);
+}
+
+/**
+ Decides whether a secondary ray is traced: rays under the contribution cutoff are dropped, and rays under the
+ roulette threshold survive with a probability proportional to their throughput, their weight compensating for it
+ @param throughput Throughput of the secondary ray
+ @param weight Weight of the secondary ray in its parent, scaled up when it survives the roulette
+ @return Whether the ray should be traced
+ */
+bool keep_secondary(float &throughput, float &weight) {
+  if (throughput < contribution_cutoff)
+    return false;
+  if (throughput < roulette_threshold) {
+    float survival = throughput / roulette_threshold;
+    if (uniform_real_distribution<float>(0.0f, 1.0f)(roulette_rng) >= survival)
+      return false;
+    throughput /= survival;
+    weight /= survival;
+  }
+  return true;
+}
+
+/**
+ Appends the refracted and reflected rays of a vertex whose hit was shaded
+ @param vertices Vertices of the tree of rays
+ @param v Index of the shaded vertex
+ @param spawned Indices of the new vertices
+ */
+void spawn_secondary(vector<PathVertex> &vertices, int v, vector<int> &spawned) {
+  PathVertex vertex = vertices[v];
+  int depth = vertex.depth - 1;
+  if (depth <= 0)
+    return;
+  unsigned features = material_flags[vertex.hit.object->material];
+  if ((features & (REFLECTIVE | REFRACTIVE)) == 0)
+    return;
+  const Material &material = vertex.hit.object->getMaterial();
+  float width = footprint(vertex);
+  if (features & REFRACTIVE) {
+    glm::vec3 refraction_direction;
+    float Ft = refraction(vertex.ray, vertex.hit, vertex.outside, refraction_direction);
+    float throughput = vertex.throughput * Ft;
+    if (keep_secondary(throughput, Ft)) {
+      STAT_INC(REFRACTION_RAYS);
+      Ray refract_ray(vertex.hit.intersection, refraction_direction);
+      vertices[v].refract_child = (int) vertices.size();
+      spawned.push_back((int) vertices.size());
+      vertices.push_back({refract_ray, Hit(), depth, !vertex.outside, Ft, throughput, width, -1, -1,
+                          glm::vec3(0.0f), child_seed(vertex.seed, 1)});
+    }
+  }
+  if (features & REFLECTIVE) {
+    float reflectivity = material.reflectivity;
+    float throughput = vertex.throughput * reflectivity;
+    if (keep_secondary(throughput, reflectivity)) {
+      STAT_INC(REFLECTION_RAYS);
+      Ray reflect_ray(vertex.hit.intersection, glm::reflect(vertex.ray.direction, vertex.hit.normal));
+      vertices[v].reflect_child = (int) vertices.size();
+      spawned.push_back((int) vertices.size());
+      vertices.push_back({reflect_ray, Hit(), depth, true, reflectivity, throughput, width, -1, -1,
+                          glm::vec3(0.0f), child_seed(vertex.seed, 0)});
     }
+  }
+}
 
-    if (closest_hit.object->getMaterial().reflectivity != 0.f) {
-      float reflection_alpha = closest_hit.object->getMaterial().reflectivity;
-      glm::vec3 reflection_direction = glm::reflect(ray.direction, closest_hit.normal);
-      Ray reflect_ray(closest_hit.intersection, reflection_direction);
-      reflect_color = glm::clamp(
-          reflection_alpha * trace_ray(reflect_ray, depth - 1, true),
-          glm::vec3(0.0f), glm::vec3(1.0f));
+/**
+ Adds the colors of the secondary rays to the direct colors of their parents. Secondary rays always come after the
+ ray spawning them, so a backward pass combines the colors bottom up
+ @param vertices Vertices of the tree of rays, the color of a root ends up being the color seen along it
+ */
+void combine_secondary(vector<PathVertex> &vertices) {
+  for (int v = (int) vertices.size() - 1; v >= 0; v--) {
+    glm::vec3 reflect_color(0.0f);
+    glm::vec3 refract_color(0.0f);
+    if (vertices[v].reflect_child >= 0) {
+      const PathVertex &child = vertices[vertices[v].reflect_child];
+      reflect_color = glm::clamp(child.weight * child.color, glm::vec3(0.0f), glm::vec3(1.0f));
+    }
+    if (vertices[v].refract_child >= 0) {
+      const PathVertex &child = vertices[vertices[v].refract_child];
+      refract_color = glm::clamp(child.weight * child.color, glm::vec3(0.0f), glm::vec3(1.0f));
     }
+    vertices[v].color = vertices[v].color + reflect_color + refract_color;
+  }
+}
 
-    color = glm::clamp(PhongModel(closest_hit.intersection, closest_hit.normal, closest_hit.uv,
-                                  glm::normalize(-ray.direction), closest_hit.object->getMaterial()),
-                       glm::vec3(0.0f), glm::vec3(1.0f));
-  } else {
-    color = glm::vec3(0.0, 0.0, 0.0);
+thread_local vector<PathVertex> path_vertices; ///< Tree of rays of the camera ray being shaded by the thread
+thread_local vector<int> path_stack; ///< Vertices of path_vertices that still have to be traced
+
+/**
+ Function that computes the color seen along a ray from its closest hit. The secondary rays are traced depth first
+ from an explicit stack, and pruned by keep_secondary
+ @param ray Ray that was traced through the scene
+ @param closest_hit Closest intersection of the ray with the scene
+ @param direct Direct light at the intersection point, without the secondary rays; ignored when null
+ @param seed Seed of the ray in a deterministic render, see camera_seed
+ @return Color at the intersection point
+ */
+glm::vec3 shade(Ray ray, const Hit &closest_hit, int depth, bool outside, glm::vec3 *direct = nullptr,
+                uint32_t seed = 0) {
+  vector<PathVertex> &vertices = path_vertices;
+  vector<int> &stack = path_stack;
+  vertices.clear();
+  vertices.push_back({ray, closest_hit, depth, outside, 1.0f, 1.0f, 0.0f, -1, -1, glm::vec3(0.0f), seed});
+  stack.assign(1, 0);
+
+  while (!stack.empty()) {
+    int v = stack.back();
+    stack.pop_back();
+    if (v != 0)
+      vertices[v].hit = find_closest_hit(vertices[v].ray);
+    const PathVertex &vertex = vertices[v];
+    if (vertex.depth <= 0 || !vertex.hit.hit)
+      continue;
+    if (deterministic)
+      seed_shading(vertex.seed);
+    vertices[v].color = glm::clamp(PhongModel(vertex.hit.intersection, vertex.hit.normal, vertex.hit.uv,
+                                              glm::normalize(-vertex.ray.direction), vertex.hit.object->material,
+                                              uv_footprint(vertex)),
+                                   glm::vec3(0.0f), glm::vec3(1.0f));
+    spawn_secondary(vertices, v, stack);
   }
 
-  return color + reflect_color + refract_color;
+  if (direct)
+    *direct = vertices[0].color;
+  combine_secondary(vertices);
+  return vertices[0].color;
+}
+
+/**
+ Functions that computes a color along the ray
+ @param ray Ray that should be traced through the scene
+ @return Color at the intersection point
+ */
+glm::vec3 trace_ray(Ray ray, int depth, bool outside) {
+  return shade(ray, find_closest_hit(ray), depth, outside);
+}
+
+/**
+ Traces a packet of camera rays: the closest hits are found for all the rays together, then each ray is shaded on its own
+ @param packet Rays that should be traced through the scene
+ @param colors Tonemapped color for every ray of the packet
+ @param samples First hit and light of every ray of the packet, ignored when null
+ @param seeds Seed of every ray of the packet in a deterministic render, see camera_seed
+ */
+void trace_packet(const RayPacket &packet, glm::vec3 *colors, CameraSample *samples = nullptr,
+                  const uint32_t *seeds = nullptr) {
+  Hit closest[RayPacket::MAX];
+  for (int i = 0; i < packet.size; i++) {
+    closest[i].hit = false;
+    closest[i].distance = INFINITY;
+  }
+  for (auto &object: objects) {
+    object->queryHits(packet, closest);
+  }
+  for (int i = 0; i < packet.size; i++) {
+    if (closest[i].hit)
+      closest[i].object->computeSurface(packet.ray(i), closest[i]);
+    uint32_t seed = seeds ? seeds[i] : 0;
+    if (samples) {
+      samples[i].hit = closest[i];
+      samples[i].color = shade(packet.ray(i), closest[i], max_depth, true, &samples[i].direct, seed);
+      colors[i] = toneMapping(samples[i].color);
+    } else {
+      colors[i] = toneMapping(shade(packet.ray(i), closest[i], max_depth, true, nullptr, seed));
+    }
+  }
 }
 
 /**
@@ -196,6 +792,44 @@ void planes() {
   objects.push_back(new Plane(glm::vec3(0, 1, -0.01), glm::vec3(0.0, 0.0, 1.0), green_diffuse));
 }
 
+/** Benchmark scene: a grid of small spheres of every opaque material in front of the walls*/
+void many_spheres() {
+  const MaterialId palette[] = {blue_specular, red_specular, yellow_specular, green_diffuse, red_diffuse,
+                                blue_diffuse, white_diffuse};
+  for (int row = 0; row < 12; row++)
+    for (int column = 0; column < 24; column++)
+      objects.push_back(new Sphere(0.4f, glm::vec3(-11.5f + (float) column, -2.5f + 1.2f * (float) row,
+                                                   12.0f + 0.5f * (float) (row % 2)),
+                                   palette[(row + column) % 7]));
+}
+
+/** Benchmark scene: rows of refractive spheres in front of reflective ones, most rays end up refracted*/
+void glass_spheres() {
+  for (int row = 0; row < 3; row++)
+    for (int column = 0; column < 6; column++)
+      objects.push_back(new Sphere(1.1f, glm::vec3(-6.25f + 2.5f * (float) column, -1.5f + 2.5f * (float) row, 8),
+                                   refractive));
+  for (int column = 0; column < 4; column++)
+    objects.push_back(new Sphere(2.0f, glm::vec3(-7.5f + 5.0f * (float) column, 1, 16), blue_specular));
+}
+
+/**
+ Builds the scene chosen with --scene: the competition scene, the many-spheres scene or the glass-heavy scene,
+ all inside the walls of planes(). Without the option the scene only holds the meshes given on the command line
+ */
+void build_scene(const string &scene) {
+  if (scene == "competition") {
+    sceneDefinition();
+  } else if (scene == "spheres") {
+    many_spheres();
+  } else if (scene == "glass") {
+    glass_spheres();
+  } else {
+    return;
+  }
+  planes();
+}
+
 //void parse_to_triangles(const vector<point> &points) {
 //  glm::mat4 translationMatrix = glm::translate(glm::vec3(0, 1.3, 3));
 //  for (int i = 0; i < points.size(); i += 3) {
@@ -205,100 +839,505 @@ void planes() {
 //  }
 //}
 
-void threading_test(int start, int end, int height, float X, float Y, float s, Image image) {
-  for (int i = start; i < end; i++)
-    for (int j = 0; j < height; j++) {
-
-      float dx = X + (float) i * s + s / 2;
-      float dy = Y - (float) j * s - s / 2;
-      float dz = 1;
-      float sp = 0.9f * s;
-      glm::vec3 origin(0, 5, -15);
-      glm::vec3 direction(dx, dy, dz);
-      glm::vec3 direction1(dx + sp, dy, dz);
-      glm::vec3 direction2(dx, dy + sp, dz);
-      glm::vec3 direction3(dx + sp, dy + sp, dz);
-      direction = glm::normalize(direction);
-      Ray ray(origin, direction);
-
-      //code for DOF effect
-      //DOF parameters
-      float f = 100.0; //focal dist
-      float r = 0.001f; //aperture
-      float n = 1.f; //num of samples
-      glm::vec3 focal_p = f * ray.direction / ray.direction.z;
-      glm::vec3 focal_p1 = f * direction1 / direction1.z;
-      glm::vec3 focal_p2 = f * direction2 / direction2.z;
-      glm::vec3 focal_p3 = f * direction3 / direction3.z;
-      glm::vec3 color = glm::vec3(0.0f, 0.0f, 0.0f);
-
-      for (int k = 0; k < (int) n; k++) {
-        float offset_x = r * (((float) (rand() % RAND_MAX)) / (float) RAND_MAX) * 2.f - 1.f;
-        float offset_y = r * (((float) (rand() % RAND_MAX)) / (float) RAND_MAX) * 2.f - 1.f;
-        glm::vec3 new_o = ray.origin + glm::vec3(offset_x, offset_y, 0.0);
-        glm::vec3 new_d = glm::normalize(focal_p - new_o);
-        glm::vec3 new_d1 = glm::normalize(focal_p1 - new_o);
-        glm::vec3 new_d2 = glm::normalize(focal_p2 - new_o);
-        glm::vec3 new_d3 = glm::normalize(focal_p3 - new_o);
-
-//                Ray new_ray(new_o, new_d);
-        Ray ray1(new_o, new_d);
-        Ray ray2(new_o, new_d1);
-        Ray ray3(new_o, new_d2);
-        Ray ray4(new_o, new_d3);
-        glm::vec3 color_local = glm::vec3(0.0f, 0.0f, 0.0f);
-        color_local += toneMapping(trace_ray(ray1, 3, true));
-        color_local += toneMapping(trace_ray(ray2, 3, true));
-        color_local += toneMapping(trace_ray(ray3, 3, true));
-        color_local += toneMapping(trace_ray(ray4, 3, true));
-        color += color_local /4.0f;
+int packet_size = 0; ///< Number of camera rays traced together, 0 traces every ray on its own
+bool wavefront = false; ///< Whether the image is rendered stage by stage over batches of rays
+int tile_size = 32; ///< Side in pixels of the tiles the image is rendered in, one batch each in wavefront mode
+thread_local minstd_rand camera_rng(random_device{}()); ///< Random numbers of the depth of field, one stream per thread
+
+/**
+ Generates the four camera rays of a pixel, sharing an origin jittered for the depth of field. A deterministic render
+ reseeds the depth of field of the thread with the pixel first, the shading of the rays being seeded by camera_seed
+ @param i Column of the pixel
+ @param j Row of the pixel
+ @param rays The four rays
+ */
+void camera_rays(int i, int j, float X, float Y, float s, Ray *rays) {
+  float dx = X + (float) i * s + s / 2;
+  float dy = Y - (float) j * s - s / 2;
+  float dz = 1;
+  float sp = 0.9f * s;
+  glm::vec3 origin(0, 5, -15);
+  glm::vec3 direction(dx, dy, dz);
+  glm::vec3 direction1(dx + sp, dy, dz);
+  glm::vec3 direction2(dx, dy + sp, dz);
+  glm::vec3 direction3(dx + sp, dy + sp, dz);
+  direction = glm::normalize(direction);
+
+  //code for DOF effect
+  //DOF parameters
+  float f = 100.0; //focal dist
+  float r = 0.001f; //aperture
+  glm::vec3 focal_p = f * direction / direction.z;
+  glm::vec3 focal_p1 = f * direction1 / direction1.z;
+  glm::vec3 focal_p2 = f * direction2 / direction2.z;
+  glm::vec3 focal_p3 = f * direction3 / direction3.z;
+
+  if (deterministic)
+    camera_rng.seed(camera_seed(i, j, -1));
+  uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  float offset_x = r * uniform(camera_rng) * 2.f - 1.f;
+  float offset_y = r * uniform(camera_rng) * 2.f - 1.f;
+  glm::vec3 new_o = origin + glm::vec3(offset_x, offset_y, 0.0);
+  rays[0] = Ray(new_o, glm::normalize(focal_p - new_o));
+  rays[1] = Ray(new_o, glm::normalize(focal_p1 - new_o));
+  rays[2] = Ray(new_o, glm::normalize(focal_p2 - new_o));
+  rays[3] = Ray(new_o, glm::normalize(focal_p3 - new_o));
+  STAT_ADD(CAMERA_RAYS, 4);
+}
+
+/** Diffuse color of the surface at a hit, textures included*/
+glm::vec3 albedo(const Hit &hit) {
+  const Material &material = hit.object->getMaterial();
+  if (material.texture)
+    return texture_lookup(material.texture, hit.uv, 0.0f);
+  return material.diffuse;
+}
+
+/**
+ Stores the color of a pixel in the image and, when the frame buffer is kept, in the frame buffer together with the
+ output variables of its four camera rays: the features of their first hits and their direct and indirect light are
+ averaged, the identifiers and texture coordinates are the ones of the first ray, which cannot be averaged
+ @param samples First hits and light of the camera rays of the pixel
+ */
+void store_pixel(Image &image, int i, int j, glm::vec3 color, const CameraSample *samples) {
+  image.setPixel(i, j, color);
+  if (!frame_buffer)
+    return;
+  int p = j * frame_buffer->width + i;
+  glm::vec3 normal(0.0f), diffuse(0.0f), direct(0.0f), indirect(0.0f);
+  float depth = 0.0f;
+  char mirror = 0;
+  for (int m = 0; m < 4; m++) {
+    const Hit &hit = samples[m].hit;
+    direct += samples[m].direct;
+    indirect += samples[m].color - samples[m].direct;
+    if (hit.hit) {
+      mirror |= (material_flags[hit.object->material] & (REFLECTIVE | REFRACTIVE)) != 0;
+      normal += hit.normal;
+      diffuse += albedo(hit);
+      depth += hit.distance;
+    }
+  }
+  const Hit &first = samples[0].hit;
+  frame_buffer->color[p] = color;
+  frame_buffer->normal[p] = glm::length(normal) > 0.0f ? glm::normalize(normal) : normal;
+  frame_buffer->albedo[p] = diffuse / 4.0f;
+  frame_buffer->depth[p] = depth / 4.0f;
+  frame_buffer->mirror[p] = mirror;
+  frame_buffer->object_id[p] = first.hit ? (float) first.object->id : -1.0f;
+  frame_buffer->material_id[p] = first.hit ? (float) first.object->material : -1.0f;
+  frame_buffer->uv[p] = first.hit ? first.uv : glm::vec2(0.0f);
+  frame_buffer->direct[p] = direct / 4.0f;
+  frame_buffer->indirect[p] = indirect / 4.0f;
+}
+
+/** Reorders a stream of rays by direction octant and Morton code of the origin so that neighbours traverse the scene alike*/
+void sort_rays(vector<int> &stream, const vector<Ray> &rays) {
+  AABB bounds;
+  for (int r: stream)
+    bounds.grow(rays[r].origin);
+  vector<pair<uint32_t, int>> keys;
+  keys.reserve(stream.size());
+  for (int r: stream)
+    keys.emplace_back(sort_key(rays[r], bounds.min, bounds.max), r);
+  sort(keys.begin(), keys.end());
+  for (int k = 0; k < (int) keys.size(); k++)
+    stream[k] = keys[k].second;
+}
+
+/**
+ Renders a tile stage by stage: every stage (camera rays, shadow rays, reflected and refracted rays of one bounce)
+ is generated for the whole tile, sorted and traced as one stream, and the colors are combined once all stages are done.
+ The result is the same as the one of trace_ray, up to the jitter of the depth of field.
+ */
+void render_wavefront_tile(int i0, int i1, int j0, int j1, float X, float Y, float s, Image &image) {
+  vector<PathVertex> vertices;
+  vector<Ray> rays;
+  for (int i = i0; i < i1; i++)
+    for (int j = j0; j < j1; j++) {
+      Ray camera[4];
+      camera_rays(i, j, X, Y, s, camera);
+      for (int m = 0; m < 4; m++) {
+        vertices.push_back({camera[m], Hit(), max_depth, true, 1.0f, 1.0f, 0.0f, -1, -1, glm::vec3(0.0f),
+                            camera_seed(i, j, m)});
+        rays.push_back(camera[m]);
       }
-      glm::vec3 res = color / n;
-      image.setPixel(i, j, res);
     }
+
+  vector<int> stream(vertices.size());
+  iota(stream.begin(), stream.end(), 0);
+  while (!stream.empty()) {
+    // closest hits of the stage
+    sort_rays(stream, rays);
+    for (int v: stream)
+      vertices[v].hit = find_closest_hit(vertices[v].ray);
+
+    // light samples and shadow rays of every hit, traced as one more stream
+    vector<LightArrays> samples(stream.size());
+    vector<Ray> shadow_rays;
+    vector<float> light_distances;
+    vector<int> shadow_lights;
+    vector<int> first_shadow(stream.size());
+    for (int k = 0; k < (int) stream.size(); k++) {
+      first_shadow[k] = (int) shadow_rays.size();
+      const Hit &hit = vertices[stream[k]].hit;
+      if (!hit.hit)
+        continue;
+      if (deterministic)
+        seed_shading(vertices[stream[k]].seed);
+      sample_lights(samples[k], hit.intersection);
+      for (int g = 0, l = 0; g < (int) samples[k].group_end.size(); g++)
+        for (; l < samples[k].group_end[g]; l++) {
+          glm::vec3 position(samples[k].x[l], samples[k].y[l], samples[k].z[l]);
+          shadow_rays.emplace_back(hit.intersection, glm::normalize(position - hit.intersection));
+          light_distances.push_back(glm::distance(position, hit.intersection));
+          shadow_lights.push_back(samples[k].group_light[g]);
+        }
+    }
+    vector<char> visibility(shadow_rays.size(), 2);
+    auto trace_shadows = [&](vector<int> &shadow_stream) {
+      sort_rays(shadow_stream, shadow_rays);
+      for (int r: shadow_stream)
+        visibility[r] = !occluded(shadow_rays[r], light_distances[r], shadow_lights[r]);
+    };
+    vector<int> shadow_stream;
+    if (shadow_probes == 0) {
+      shadow_stream.resize(shadow_rays.size());
+      iota(shadow_stream.begin(), shadow_stream.end(), 0);
+      trace_shadows(shadow_stream);
+    } else {
+      // the probes of every group first, then the other samples of the groups whose probes disagree
+      for (int k = 0; k < (int) stream.size(); k++) {
+        int first = first_shadow[k];
+        for (int end: samples[k].group_end) {
+          int probes = min(shadow_probes, first_shadow[k] + end - first);
+          for (int p = 0; p < probes; p++)
+            shadow_stream.push_back(first + probe_index(p, probes, first_shadow[k] + end - first));
+          first = first_shadow[k] + end;
+        }
+      }
+      trace_shadows(shadow_stream);
+      shadow_stream.clear();
+      for (int k = 0; k < (int) stream.size(); k++) {
+        int first = first_shadow[k];
+        for (int end: samples[k].group_end) {
+          end += first_shadow[k];
+          int lit = 0, traced = 0;
+          for (int r = first; r < end; r++)
+            if (visibility[r] != 2) {
+              lit += visibility[r];
+              traced++;
+            }
+          if (lit == 0 || lit == traced) {
+            fill(visibility.begin() + first, visibility.begin() + end, lit > 0);
+          } else {
+            for (int r = first; r < end; r++)
+              if (visibility[r] == 2)
+                shadow_stream.push_back(r);
+          }
+          first = end;
+        }
+      }
+      trace_shadows(shadow_stream);
+    }
+
+    // direct light and the secondary rays of the next stage
+    vector<int> next;
+    int first_spawned = (int) vertices.size();
+    for (int k = 0; k < (int) stream.size(); k++) {
+      int v = stream[k];
+      if (!vertices[v].hit.hit)
+        continue;
+      Ray ray = vertices[v].ray;
+      Hit hit = vertices[v].hit;
+      vertices[v].color = glm::clamp(PhongModel(hit.intersection, hit.normal, hit.uv, glm::normalize(-ray.direction),
+                                                hit.object->material, uv_footprint(vertices[v]), &samples[k],
+                                                visibility.data() + first_shadow[k]),
+                                     glm::vec3(0.0f), glm::vec3(1.0f));
+      if (deterministic)
+        seed_shading(vertices[v].seed);
+      spawn_secondary(vertices, v, next);
+    }
+    for (int k = first_spawned; k < (int) vertices.size(); k++)
+      rays.push_back(vertices[k].ray);
+    stream = next;
+  }
+
+  // the camera rays are the first vertices, their colors are still the direct light
+  int pixels = (i1 - i0) * (j1 - j0);
+  vector<CameraSample> camera_samples;
+  if (frame_buffer)
+    for (int v = 0; v < 4 * pixels; v++)
+      camera_samples.push_back({vertices[v].hit, vertices[v].color, glm::vec3(0.0f)});
+  combine_secondary(vertices);
+
+  int v = 0;
+  CameraSample samples[4];
+  for (int i = i0; i < i1; i++)
+    for (int j = j0; j < j1; j++, v += 4) {
+      glm::vec3 color_local = glm::vec3(0.0f, 0.0f, 0.0f);
+      for (int m = 0; m < 4; m++) {
+        color_local += toneMapping(vertices[v + m].color);
+        if (frame_buffer) {
+          samples[m] = camera_samples[v + m];
+          samples[m].color = vertices[v + m].color;
+        }
+      }
+      store_pixel(image, i, j, color_local / 4.0f, samples);
+    }
+}
+
+/**
+ Walks columns of the image tile by tile, measuring the hardware events of every tile when --perf is given
+ @param render Function rendering the pixels of a tile, given its columns i0 to i1 and rows j0 to j1, ends excluded
+ */
+template<class Render>
+void render_tiles(int start, int end, int height, Render render) {
+  for (int i0 = start; i0 < end; i0 += tile_size)
+    for (int j0 = 0; j0 < height; j0 += tile_size) {
+      int i1 = min(i0 + tile_size, end), j1 = min(j0 + tile_size, height);
+      PerfScope perf(RENDER_PHASE);
+      render(i0, i1, j0, j1);
+      perf.stop_tile(i0, i1, j0, j1);
+    }
+}
+
+/**
+ Renders columns of the image in wavefront mode, one tile after the other
+ */
+void threading_wavefront(int start, int end, int height, float X, float Y, float s, Image image) {
+  render_tiles(start, end, height, [&](int i0, int i1, int j0, int j1) {
+    CostMap::Scope cost(cost_map);
+    TraceScope trace("tile", "render");
+    render_wavefront_tile(i0, i1, j0, j1, X, Y, s, image);
+    if (cost_map)
+      cost_map->record(cost, i0, i1, j0, j1);
+  });
+}
+
+/**
+ Renders columns of the image tracing camera rays in packets: the four rays of packet_size / 4 pixels
+ stacked in a column of a tile form one packet
+ */
+void threading_packets(int start, int end, int height, float X, float Y, float s, Image image) {
+  int pixels = packet_size / 4;
+  render_tiles(start, end, height, [&](int i0, int i1, int j0, int j1) {
+    for (int i = i0; i < i1; i++)
+      for (int k = j0; k < j1; k += pixels) {
+        int count = min(pixels, j1 - k);
+        CostMap::Scope cost(cost_map);
+        RayPacket packet;
+        packet.size = 4 * count;
+        uint32_t seeds[RayPacket::MAX];
+        for (int p = 0; p < count; p++) {
+          Ray camera[4];
+          camera_rays(i, k + p, X, Y, s, camera);
+          for (int m = 0; m < 4; m++) {
+            packet.set(4 * p + m, camera[m]);
+            seeds[4 * p + m] = camera_seed(i, k + p, m);
+          }
+        }
+        glm::vec3 colors[RayPacket::MAX];
+        CameraSample samples[RayPacket::MAX];
+        trace_packet(packet, colors, frame_buffer ? samples : nullptr, seeds);
+        for (int p = 0; p < count; p++) {
+          glm::vec3 color = (colors[4 * p] + colors[4 * p + 1] + colors[4 * p + 2] + colors[4 * p + 3]) / 4.0f;
+          store_pixel(image, i, k + p, color, samples + 4 * p);
+        }
+        if (cost_map)
+          cost_map->record(cost, i, i + 1, k, k + count);
+      }
+  });
 }
 
+/**
+ Renders columns of the image tracing the rays of every pixel one by one
+ */
+void threading_scalar(int start, int end, int height, float X, float Y, float s, Image image) {
+  render_tiles(start, end, height, [&](int i0, int i1, int j0, int j1) {
+    for (int i = i0; i < i1; i++)
+      for (int j = j0; j < j1; j++) {
+        float n = 1.f; //num of samples
+        glm::vec3 color = glm::vec3(0.0f, 0.0f, 0.0f);
+        CostMap::Scope cost(cost_map);
+        CameraSample samples[4];
+
+        for (int k = 0; k < (int) n; k++) {
+          Ray camera[4];
+          camera_rays(i, j, X, Y, s, camera);
+          glm::vec3 color_local = glm::vec3(0.0f, 0.0f, 0.0f);
+          // trace_ray, keeping the first hits and the direct light for the frame buffer
+          for (int m = 0; m < 4; m++) {
+            samples[m].hit = find_closest_hit(camera[m]);
+            samples[m].color = shade(camera[m], samples[m].hit, max_depth, true, &samples[m].direct,
+                                     camera_seed(i, j, m));
+            color_local += toneMapping(samples[m].color);
+          }
+          color += color_local /4.0f;
+        }
+        glm::vec3 res = color / n;
+        store_pixel(image, i, j, res, samples);
+        if (cost_map)
+          cost_map->record(cost, i, i + 1, j, j + 1);
+      }
+  });
+}
+
+/**
+ Renders columns of the image with the chosen renderer and publishes the statistics of the thread
+ */
+void threading_test(int start, int end, int height, float X, float Y, float s, Image image) {
+  if (deterministic)
+    shadow_coherence = ShadowCoherence(); // the shadow states left by the previous task of the thread
+  if (wavefront) {
+    threading_wavefront(start, end, height, X, Y, s, image);
+  } else if (packet_size > 0) {
+    threading_packets(start, end, height, X, Y, s, image);
+  } else {
+    threading_scalar(start, end, height, X, Y, s, image);
+  }
+  flush_occluder_stats();
+  if (texture_cache)
+    texture_cache->flush();
+  render_stats.flush();
+}
+
+/**
+ Reads the hierarchy to build over the meshes from the --layout option, --sbvh asks for a BVH with spatial splits
+ */
+MeshLayout mesh_layout(const Options &options) {
+  string layout = options.get("layout", options.has("sbvh") ? "bvh" : "tree");
+  if (layout == "bvh")
+    return MeshLayout::Bvh;
+  if (layout == "compact")
+    return MeshLayout::Compact;
+  return MeshLayout::Tree;
+}
+
+/**
+ Reads how the BVH layouts are built: --sbvh enables spatial splits,
+ --sbvh-growth=x caps the extra triangle references they may add to a fraction x of the triangles
+ */
+BVHSettings bvh_settings(const Options &options) {
+  BVHSettings settings;
+  settings.spatial_splits = options.has("sbvh");
+  settings.max_growth = options.get("sbvh-growth", settings.max_growth);
+  return settings;
+}
+
+
 int main(int argc, const char *argv[]) {
-  clock_t t = clock(); // variable for keeping the time of the rendering
+  steady_clock::time_point t = steady_clock::now(); // variable for keeping the time of the loading
+  Options options = parse_options(argc, argv);
+  trace_recorder.enabled = options.has("trace");
+  perf_enabled = options.has("perf") || options.has("perf-tiles");
+  trace_recorder.name_thread("main");
+  MeshLayout layout = mesh_layout(options);
+  BVHSettings settings = bvh_settings(options);
+  packet_size = glm::clamp(options.get("packet", 0) / 4 * 4, 0, RayPacket::MAX);
+  wavefront = options.has("wavefront");
+  max_depth = options.get("max-depth", max_depth);
+  contribution_cutoff = options.get("cutoff", contribution_cutoff);
+  roulette_threshold = options.get("roulette", roulette_threshold);
+  tile_size = max(1, options.get("tile", tile_size));
+  light_samples = max(1, options.get("light-samples", light_samples));
+  light_picks = max(1, options.get("light-picks", light_picks));
+  shadow_probes = max(0, options.get("shadow-probes", shadow_probes));
+  coherence_radius = options.get("coherence-radius", coherence_radius);
+  cache_occluders = options.has("occluder-cache");
+  deterministic = options.has("deterministic");
+  render_seed = (uint32_t) options.get("deterministic", (int) render_seed);
+  if (options.has("bake-textures")) {
+    texture_cache = new TextureCache();
+    texture_cache->resolution = 1 << (int) round(log2(max(1, options.get("bake-resolution", texture_cache->resolution))));
+    texture_cache->extent = options.get("bake-extent", texture_cache->extent);
+    texture_cache->capacity = (size_t) options.get("texture-cache-mb", 64) << 20;
+    texture_cache->trilinear = options.get("texture-filter", "bilinear") == "trilinear";
+  }
 
 //  int width = 2048; //width of the image
 //  int height = 1536; // height of the image
   int width = 1024; //width of the image
   int height = 768; // height of the image
+  width = max(1, options.get("width", width));
+  height = max(1, options.get("height", height));
 //  int width = 512; //width of the image
 //  int height = 384; // height of the image
 
   float fov = 90; // field of view
-  if (argc >= 2) {
-    objects.push_back(new Figure(argv[1],true));
+  if (options.positional.size() >= 1) {
+    objects.push_back(new Figure(options.positional[0], true, layout, settings));
   }
-  if (argc >= 3){
-    objects.push_back(new Figure(argv[2],false));
+  if (options.positional.size() >= 2) {
+    objects.push_back(new Figure(options.positional[1], false, layout, settings));
   }
 
-  t = clock() - t;
-  cout << "It took " << ((float) t) / CLOCKS_PER_SEC << " seconds to load the mesh." << endl;
+  cout << "It took " << std::chrono::duration<float>(steady_clock::now() - t).count() << " seconds to load the mesh."
+       << endl;
   time_t timet = system_clock::to_time_t(system_clock::now());
   struct tm *time = localtime(&timet);
   cout << "Current time: " << put_time(time, "%X") << '\n';
 //  sceneDefinition(); // Let's define a scene
 //  planes();
+  build_scene(options.get("scene", ""));
   position_lights();
+  for (int k = 0; k < (int) objects.size(); k++)
+    objects[k]->id = k;
+  if (options.has("light-tree")) {
+    STAT_TIMER(build_timer, BUILD_PHASE);
+    TraceScope trace("light tree build", "phase");
+    PerfScope perf(BUILD_PHASE);
+    light_tree = new LightTree(area_lights);
+  }
 
   Image image(width, height); // Create an image where we will store the result
+  if (options.has("heatmap"))
+    cost_map = new CostMap(width, height);
+  if (options.has("denoise") || options.has("aov"))
+    frame_buffer = new FrameBuffer(width, height);
 
   auto s = (float) (2 * tan(0.5 * fov / 180 * M_PI) / width);
   auto X = (float) (-s * (float) width / 2.0);
   auto Y = (float) (s * (float) height / 2.0);
+  pixel_spread = s;
   uint n = thread::hardware_concurrency() * 2;
   uint slice = floor(width / n);
+  if (deterministic) {
+    // slices of whole tiles, so that the tiles and the pixels a task renders do not depend on the machine
+    slice = tile_size;
+    n = width / slice;
+  }
   int x = 0;
-  thread_pool pool;
+  thread_pool pool(max(0, options.get("threads", 0)));
+  STAT_TIMER(render_timer, RENDER_PHASE);
+  TraceScope render_trace("render", "phase");
   for (uint i = 0; i < n; i++, x++) {
-    pool.push_task(threading_test, slice * x, slice * (x + 1), height, X, Y, s, ref(image));
+    pool.push_task(traced_task("columns " + to_string(slice * x) + "-" + to_string(slice * (x + 1)),
+                               bind(threading_test, slice * x, slice * (x + 1), height, X, Y, s, image)));
   }
-  pool.push_task(threading_test, slice * x, width, height, X, Y, s, ref(image));
+  pool.push_task(traced_task("columns " + to_string(slice * x) + "-" + to_string(width),
+                             bind(threading_test, slice * x, width, height, X, Y, s, image)));
   pool.wait_for_tasks();
+  render_trace.stop();
+  STAT_TIMER_STOP(render_timer);
+  if (options.has("denoise")) {
+    TraceScope trace("denoise", "phase");
+    DenoiseSettings denoise_settings;
+    denoise_settings.iterations = max(1, options.get("denoise", denoise_settings.iterations));
+    denoise_settings.sigma_color = options.get("denoise-color", denoise_settings.sigma_color);
+    denoise_settings.sigma_normal = options.get("denoise-normal", denoise_settings.sigma_normal);
+    denoise_settings.sigma_albedo = options.get("denoise-albedo", denoise_settings.sigma_albedo);
+    denoise_settings.sigma_depth = options.get("denoise-depth", denoise_settings.sigma_depth);
+    denoise(*frame_buffer, denoise_settings, pool);
+    frame_buffer->toImage(image);
+  }
+  if (cache_occluders) {
+    cout << "Occluder cache: " << occluder_hits << " hits, " << occluder_misses << " misses" << endl;
+  }
+  if (texture_cache) {
+    cout << "Texture cache: " << texture_cache->size() << " tiles, " << texture_cache->hits << " hits, "
+         << texture_cache->misses << " misses, " << texture_cache->evictions << " evictions" << endl;
+  }
 //    for (int i = 0; i < width; i++)
 //        for (int j = 0; j < height; j++) {
 //
@@ -357,11 +1396,55 @@ int main(int argc, const char *argv[]) {
   cout << "Current time: " << put_time(time, "%X") << '\n';
 
   // Writing the final results of the rendering
-  if (argc == 3) {
-    image.writeImage(argv[2]);
+  STAT_TIMER(write_timer, WRITE_PHASE);
+  TraceScope write_trace("image write", "phase");
+  PerfScope write_perf(WRITE_PHASE);
+  if (options.has("output")) {
+    image.writeImage(options.get("output", "./result1.ppm").c_str());
+  } else if (options.positional.size() == 2) {
+    image.writeImage(options.positional[1].c_str());
   } else {
     image.writeImage("./result1.ppm");
   }
+  if (cost_map)
+    cost_map->write(options.get("heatmap", "./result1_cost"));
+  if (options.has("aov"))
+    frame_buffer->writeAovs(options.get("aov", "./result1_aov"));
+  STAT_TIMER_STOP(write_timer);
+  write_trace.stop();
+  write_perf.stop();
+  if (trace_recorder.enabled) {
+    ofstream trace(options.get("trace", "trace.json"));
+    trace_recorder.write_json(trace);
+  }
+
+  bool passed = true;
+  if (options.has("reference")) {
+    Image *reference = Image::readImage(options.get("reference", "").c_str());
+    if (reference) {
+      passed = check_image(image, *reference, options);
+    } else {
+      cout << "Cannot read the reference image " << options.get("reference", "") << endl;
+      passed = false;
+    }
+  }
+
+#if RENDER_STATS
+  render_stats.flush();
+  if (options.has("stats"))
+    render_stats.print(cout);
+  if (options.has("stats-json")) {
+    ofstream json(options.get("stats-json", "stats.json"));
+    render_stats.write_json(json);
+  }
+#endif
+  if (perf_enabled) {
+    print_perf(cout);
+    if (options.has("perf-tiles")) {
+      ofstream tiles(options.get("perf-tiles", "perf_tiles.csv"));
+      write_perf_tiles(tiles);
+    }
+  }
 //  test();
-  return 0;
+  return passed ? 0 : 1;
 }
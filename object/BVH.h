@@ -0,0 +1,516 @@
+//
+// Created by Volodymyr Karpenko on 16.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION_OBJECT_BVH_H_
+#define USI_RENDERING_COMPETITION_OBJECT_BVH_H_
+#include "../glm/glm.hpp"
+#include "../Ray.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+/**
+ Axis aligned bounding box
+ */
+struct AABB {
+  glm::vec3 min = glm::vec3(INFINITY);
+  glm::vec3 max = glm::vec3(-INFINITY);
+
+  void grow(glm::vec3 p) {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+  void grow(const AABB &box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+  }
+  bool empty() const {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+  }
+  glm::vec3 center() const {
+    return 0.5f * (min + max);
+  }
+  float area() const {
+    if (empty())
+      return 0.f;
+    glm::vec3 d = max - min;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  /**
+   Slab test of a ray against the box
+   @param origin Origin of the ray
+   @param inv_direction Component-wise inverse of the direction of the ray
+   @param t_max Distance beyond which hits are not interesting
+   @param t_near Distance at which the ray enters the box
+   */
+  bool intersect(glm::vec3 origin, glm::vec3 inv_direction, float t_max, float &t_near) const {
+    // written so that the NaN of an origin lying on a flat slab never restricts the interval, like the SSE version
+    t_near = 0.f;
+    float t_far = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      float t1 = (min[axis] - origin[axis]) * inv_direction[axis];
+      float t2 = (max[axis] - origin[axis]) * inv_direction[axis];
+      float t_small = t2 < t1 ? t2 : t1;
+      float t_big = t1 < t2 ? t2 : t1;
+      t_near = t_near < t_small ? t_small : t_near;
+      t_far = t_big < t_far ? t_big : t_far;
+    }
+    return t_near <= t_far;
+  }
+
+  /**
+   Slab test of the rays of a packet against the box, four rays at a time
+   @param packet Rays to test
+   @param t_max Distance beyond which hits are not interesting, per ray
+   @param active Rays that should be tested, one bit per ray
+   @return Rays entering the box, one bit per ray
+   */
+  uint32_t intersect(const RayPacket &packet, const float *t_max, uint32_t active) const {
+    uint32_t mask = 0;
+    for (int g = 0; g < packet.size; g += 4) {
+      if (((active >> g) & 0xfu) == 0)
+        continue;
+#ifdef __SSE2__
+      __m128 t_near = _mm_setzero_ps();
+      __m128 t_far = _mm_loadu_ps(t_max + g);
+      for (int axis = 0; axis < 3; axis++) {
+        __m128 o = _mm_load_ps(packet.origin[axis] + g);
+        __m128 inv = _mm_load_ps(packet.inv_direction[axis] + g);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(min[axis]), o), inv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(max[axis]), o), inv);
+        // _mm_min_ps and _mm_max_ps return their second operand when one is NaN, so these are the comparisons of
+        // the scalar version operand for operand and a NaN slab leaves the interval as it is there too
+        t_near = _mm_max_ps(_mm_min_ps(t2, t1), t_near);
+        t_far = _mm_min_ps(_mm_max_ps(t2, t1), t_far);
+      }
+      uint32_t hits = (uint32_t) _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+      uint32_t hits = 0;
+      for (int i = 0; i < 4; i++) {
+        glm::vec3 o(packet.origin[0][g + i], packet.origin[1][g + i], packet.origin[2][g + i]);
+        glm::vec3 inv(packet.inv_direction[0][g + i], packet.inv_direction[1][g + i], packet.inv_direction[2][g + i]);
+        float t_near;
+        if (intersect(o, inv, t_max[g + i], t_near))
+          hits |= 1u << i;
+      }
+#endif
+      mask |= hits << g;
+    }
+    return mask & active;
+  }
+};
+
+/**
+ Node of a binary BVH stored in a flat array
+ */
+struct BVHNode {
+  AABB bounds;
+  int first; ///< For a leaf the first entry in the reference list, otherwise the index of the left child (the right child follows it)
+  int count; ///< Number of triangles in a leaf, 0 for inner nodes
+  bool leaf() const {
+    return count > 0;
+  }
+};
+
+/**
+ Node of a 4-wide BVH occupying exactly one cache line.
+ The bounds of the children are quantized to 8 bits on a grid spanned from the bounds of the node itself,
+ with a power of two cell size per axis, and rounded outwards so that the decoded boxes always contain the real ones.
+ */
+struct alignas(64) CompactNode {
+  glm::vec3 origin; ///< Minimum corner of the node bounds, origin of the quantization grid
+  int8_t exponent[3]; ///< Cell size of the grid along each axis as a power of two
+  uint8_t child_count; ///< Number of used child slots
+  uint8_t lo[3][4]; ///< Quantized minimum corner of every child, per axis
+  uint8_t hi[3][4]; ///< Quantized maximum corner of every child, per axis
+  uint8_t triangle_count[4]; ///< Number of triangles for a leaf child, 0 for an inner child
+  uint32_t child[4]; ///< First reference of a leaf child or index of an inner child
+
+  float scale(int axis) const {
+    return ldexpf(1.f, exponent[axis]);
+  }
+  /** Decodes the box of one child, this is the only place turning quantized values back to floats*/
+  AABB child_bounds(int i) const {
+    AABB box;
+    for (int axis = 0; axis < 3; axis++) {
+      float s = scale(axis);
+      box.min[axis] = origin[axis] + (float) lo[axis][i] * s;
+      box.max[axis] = origin[axis] + (float) hi[axis][i] * s;
+    }
+    return box;
+  }
+};
+static_assert(sizeof(CompactNode) == 64, "CompactNode must fill exactly one cache line");
+
+/**
+ Settings of the BVH builder
+ */
+struct BVHSettings {
+  bool spatial_splits = false; ///< Also consider splitting triangles between the children (SBVH)
+  float max_growth = 0.3f; ///< With spatial splits, the number of references may grow by at most this fraction of the triangles
+  float overlap = 1e-5f; ///< Spatial splits are only tried where children overlap by more than this fraction of the root area
+};
+
+/**
+ Builds a binary BVH over a set of triangles with binned SAH object splits, or with spatial splits as well
+ following the SBVH of Stich et al., and optionally collapses it into the compact 4-wide layout
+ */
+class BVHBuilder {
+ private:
+  static const int BINS = 16;
+  static const int MAX_LEAF_SIZE = 4;
+  static const int MAX_DEPTH = 64; ///< Below this depth only median splits are made, which bounds the traversal stack
+
+  /** A triangle, or the part of it inside the bounds when it was cut by spatial splits*/
+  struct Reference {
+    AABB bounds;
+    int index;
+  };
+
+  /** Best split of a node found so far*/
+  struct Split {
+    float cost = INFINITY; ///< Surface area heuristic of the two children, unnormalized
+    int axis = 0;
+    float position = 0;
+    bool spatial = false;
+    AABB left, right;
+  };
+
+  BVHSettings settings;
+  const vector<glm::vec3> *vertices = nullptr;
+  float root_area = 0;
+  int budget = 0; ///< Number of references spatial splits may still add
+
+  static AABB overlap(const AABB &a, const AABB &b) {
+    AABB box;
+    box.min = glm::max(a.min, b.min);
+    box.max = glm::min(a.max, b.max);
+    return box;
+  }
+
+  /** Bounds of the part of a triangle between two planes orthogonal to an axis, limited to the reference bounds*/
+  AABB clip(const Reference &ref, int axis, float lo, float hi) const {
+    AABB box;
+    for (int i = 0; i < 3; i++) {
+      glm::vec3 p = (*vertices)[3 * ref.index + i];
+      glm::vec3 q = (*vertices)[3 * ref.index + (i + 1) % 3];
+      if (p[axis] >= lo && p[axis] <= hi)
+        box.grow(p);
+      for (float plane: {lo, hi}) {
+        if ((p[axis] < plane && q[axis] > plane) || (p[axis] > plane && q[axis] < plane)) {
+          float t = (plane - p[axis]) / (q[axis] - p[axis]);
+          glm::vec3 x = glm::mix(p, q, t);
+          x[axis] = plane;
+          box.grow(x);
+        }
+      }
+    }
+    return overlap(box, ref.bounds);
+  }
+
+  /** Fallback when there is no usable split plane, e.g. all centroids coincide*/
+  static void halve(const vector<Reference> &refs, vector<Reference> &left, vector<Reference> &right) {
+    int median = (int) refs.size() / 2;
+    left.assign(refs.begin(), refs.begin() + median);
+    right.assign(refs.begin() + median, refs.end());
+  }
+
+  void make_leaf(int node, const vector<Reference> &refs) {
+    nodes[node].first = (int) indices.size();
+    nodes[node].count = (int) refs.size();
+    for (auto &ref: refs)
+      indices.push_back(ref.index);
+  }
+
+  /** Looks for a binned object split cheaper than the current best*/
+  void find_object_split(const vector<Reference> &refs, Split &best) {
+    AABB centroids;
+    for (auto &ref: refs)
+      centroids.grow(ref.bounds.center());
+
+    for (int axis = 0; axis < 3; axis++) {
+      float lo = centroids.min[axis], hi = centroids.max[axis];
+      if (hi <= lo)
+        continue;
+      AABB bin_bounds[BINS];
+      int bin_count[BINS] = {0};
+      float k = (float) BINS / (hi - lo);
+      for (auto &ref: refs) {
+        int b = min(BINS - 1, (int) ((ref.bounds.center()[axis] - lo) * k));
+        bin_bounds[b].grow(ref.bounds);
+        bin_count[b]++;
+      }
+      AABB right_bounds[BINS];
+      int right_count[BINS];
+      AABB box;
+      int count = 0;
+      for (int b = BINS - 1; b > 0; b--) {
+        box.grow(bin_bounds[b]);
+        count += bin_count[b];
+        right_bounds[b] = box;
+        right_count[b] = count;
+      }
+      box = AABB();
+      count = 0;
+      for (int b = 0; b < BINS - 1; b++) {
+        box.grow(bin_bounds[b]);
+        count += bin_count[b];
+        if (count == 0 || right_count[b + 1] == 0)
+          continue;
+        float cost = box.area() * (float) count + right_bounds[b + 1].area() * (float) right_count[b + 1];
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.position = lo + (float) (b + 1) / k;
+          best.spatial = false;
+          best.left = box;
+          best.right = right_bounds[b + 1];
+        }
+      }
+    }
+  }
+
+  /**
+   Looks for a binned spatial split cheaper than the current best.
+   References crossing a bin boundary are clipped to every bin they touch, so the bins hold tight boxes.
+   */
+  void find_spatial_split(const vector<Reference> &refs, const AABB &bounds, Split &best) {
+    for (int axis = 0; axis < 3; axis++) {
+      float lo = bounds.min[axis], hi = bounds.max[axis];
+      if (hi <= lo)
+        continue;
+      AABB bin_bounds[BINS];
+      int entries[BINS] = {0};
+      int exits[BINS] = {0};
+      float width = (hi - lo) / (float) BINS;
+      for (auto &ref: refs) {
+        int first = glm::clamp((int) ((ref.bounds.min[axis] - lo) / width), 0, BINS - 1);
+        int last = glm::clamp((int) ((ref.bounds.max[axis] - lo) / width), first, BINS - 1);
+        if (first == last) {
+          bin_bounds[first].grow(ref.bounds);
+        } else {
+          for (int b = first; b <= last; b++) {
+            float bin_lo = b == first ? -INFINITY : lo + (float) b * width;
+            float bin_hi = b == last ? INFINITY : lo + (float) (b + 1) * width;
+            bin_bounds[b].grow(clip(ref, axis, bin_lo, bin_hi));
+          }
+        }
+        entries[first]++;
+        exits[last]++;
+      }
+      AABB right_bounds[BINS];
+      int right_count[BINS];
+      AABB box;
+      int count = 0;
+      for (int b = BINS - 1; b > 0; b--) {
+        box.grow(bin_bounds[b]);
+        count += exits[b];
+        right_bounds[b] = box;
+        right_count[b] = count;
+      }
+      box = AABB();
+      count = 0;
+      for (int b = 0; b < BINS - 1; b++) {
+        box.grow(bin_bounds[b]);
+        count += entries[b];
+        int right = right_count[b + 1];
+        if (count == 0 || right == 0 || count == (int) refs.size() || right == (int) refs.size())
+          continue;
+        if (count + right - (int) refs.size() > budget)
+          continue;
+        float cost = box.area() * (float) count + right_bounds[b + 1].area() * (float) right;
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.position = lo + (float) (b + 1) * width;
+          best.spatial = true;
+          best.left = box;
+          best.right = right_bounds[b + 1];
+        }
+      }
+    }
+  }
+
+  void subdivide(int node, vector<Reference> refs, int depth) {
+    AABB bounds;
+    for (auto &ref: refs)
+      bounds.grow(ref.bounds);
+    nodes[node].bounds = bounds;
+
+    if ((int) refs.size() <= 1) {
+      make_leaf(node, refs);
+      return;
+    }
+
+    Split split;
+    if (depth < MAX_DEPTH && bounds.area() > 0) {
+      find_object_split(refs, split);
+      // spatial splits only pay off where the object split leaves the children overlapping
+      if (settings.spatial_splits && budget > 0 && split.cost != INFINITY &&
+          overlap(split.left, split.right).area() > settings.overlap * root_area)
+        find_spatial_split(refs, bounds, split);
+    }
+    if ((int) refs.size() <= MAX_LEAF_SIZE && split.cost >= bounds.area() * (float) refs.size()) {
+      make_leaf(node, refs);
+      return;
+    }
+
+    vector<Reference> left, right;
+    if (split.cost == INFINITY) {
+      halve(refs, left, right);
+    } else if (!split.spatial) {
+      for (auto &ref: refs)
+        (ref.bounds.center()[split.axis] < split.position ? left : right).push_back(ref);
+    } else {
+      for (auto &ref: refs) {
+        if (ref.bounds.max[split.axis] <= split.position) {
+          left.push_back(ref);
+        } else if (ref.bounds.min[split.axis] >= split.position) {
+          right.push_back(ref);
+        } else {
+          Reference l = {clip(ref, split.axis, -INFINITY, split.position), ref.index};
+          Reference r = {clip(ref, split.axis, split.position, INFINITY), ref.index};
+          if (!l.bounds.empty())
+            left.push_back(l);
+          if (!r.bounds.empty())
+            right.push_back(r);
+        }
+      }
+      budget = max(0, budget - (int) (left.size() + right.size() - refs.size()));
+    }
+    // rounding at the split plane may still leave one side with everything
+    if (left.empty() || right.empty() || left.size() == refs.size() || right.size() == refs.size())
+      halve(refs, left, right);
+    refs.clear();
+    refs.shrink_to_fit();
+
+    int first = (int) nodes.size();
+    nodes[node].first = first;
+    nodes[node].count = 0;
+    nodes.push_back(BVHNode());
+    nodes.push_back(BVHNode());
+    subdivide(first, std::move(left), depth + 1);
+    subdivide(first + 1, std::move(right), depth + 1);
+  }
+
+  void quantize(CompactNode &cn, const AABB &parent, const AABB *children, int n) {
+    cn.origin = parent.min;
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = parent.max[axis] - parent.min[axis];
+      int e = extent > 0 ? (int) ceil(log2(extent / 255.f)) : -64;
+      e = glm::clamp(e, -64, 64);
+      while (e < 64 && cn.origin[axis] + 255.f * ldexpf(1.f, e) < parent.max[axis])
+        e++;
+      cn.exponent[axis] = (int8_t) e;
+    }
+    for (int i = 0; i < n; i++) {
+      for (int axis = 0; axis < 3; axis++) {
+        float s = cn.scale(axis);
+        int lo = glm::clamp((int) floor((children[i].min[axis] - cn.origin[axis]) / s), 0, 255);
+        int hi = glm::clamp((int) ceil((children[i].max[axis] - cn.origin[axis]) / s), 0, 255);
+        while (lo > 0 && cn.origin[axis] + (float) lo * s > children[i].min[axis])
+          lo--;
+        while (hi < 255 && cn.origin[axis] + (float) hi * s < children[i].max[axis])
+          hi++;
+        cn.lo[axis][i] = (uint8_t) lo;
+        cn.hi[axis][i] = (uint8_t) hi;
+      }
+    }
+  }
+
+  /** Turns a binary node and up to three levels below it into one compact node*/
+  int collapse(int node) {
+    vector<int> children;
+    if (nodes[node].leaf()) {
+      children.push_back(node);
+    } else {
+      children.push_back(nodes[node].first);
+      children.push_back(nodes[node].first + 1);
+    }
+    while (children.size() < 4) {
+      int widest = -1;
+      for (int i = 0; i < (int) children.size(); i++) {
+        if (!nodes[children[i]].leaf() &&
+            (widest < 0 || nodes[children[i]].bounds.area() > nodes[children[widest]].bounds.area()))
+          widest = i;
+      }
+      if (widest < 0)
+        break;
+      int opened = children[widest];
+      children[widest] = nodes[opened].first;
+      children.push_back(nodes[opened].first + 1);
+    }
+
+    int index = (int) compact_nodes.size();
+    compact_nodes.push_back(CompactNode());
+    CompactNode cn{};
+    cn.child_count = (uint8_t) children.size();
+    AABB boxes[4];
+    for (int i = 0; i < (int) children.size(); i++) {
+      const BVHNode &child = nodes[children[i]];
+      boxes[i] = child.bounds;
+      if (child.leaf()) {
+        cn.triangle_count[i] = (uint8_t) child.count;
+        cn.child[i] = (uint32_t) child.first;
+      } else {
+        cn.triangle_count[i] = 0;
+        cn.child[i] = (uint32_t) collapse(children[i]);
+      }
+    }
+    quantize(cn, nodes[node].bounds, boxes, (int) children.size());
+    compact_nodes[index] = cn;
+    return index;
+  }
+
+ public:
+  vector<BVHNode> nodes; ///< Binary nodes, the root is the first one
+  vector<CompactNode> compact_nodes; ///< Compact nodes, the root is the first one
+  vector<int> indices; ///< Triangle indices referenced by the leaves
+
+  /**
+   Builds the binary BVH
+   @param triangle_vertices Three vertices for every triangle
+   @param bvh_settings Whether and how much spatial splits may be used
+   */
+  void build(const vector<glm::vec3> &triangle_vertices, BVHSettings bvh_settings = BVHSettings()) {
+    settings = bvh_settings;
+    vertices = &triangle_vertices;
+    int triangle_count = (int) triangle_vertices.size() / 3;
+    budget = settings.spatial_splits ? (int) (settings.max_growth * (float) triangle_count) : 0;
+
+    vector<Reference> refs;
+    refs.reserve(triangle_count);
+    AABB root;
+    for (int i = 0; i < triangle_count; i++) {
+      Reference ref;
+      ref.index = i;
+      for (int j = 0; j < 3; j++)
+        ref.bounds.grow(triangle_vertices[3 * i + j]);
+      root.grow(ref.bounds);
+      refs.push_back(ref);
+    }
+    root_area = root.area();
+    nodes.clear();
+    indices.clear();
+    nodes.push_back(BVHNode());
+    subdivide(0, std::move(refs), 0);
+    vertices = nullptr;
+  }
+
+  /** Converts the binary BVH into compact nodes and releases the binary nodes*/
+  void compact() {
+    compact_nodes.clear();
+    collapse(0);
+    nodes.clear();
+    nodes.shrink_to_fit();
+  }
+};
+
+#endif //USI_RENDERING_COMPETITION_OBJECT_BVH_H_
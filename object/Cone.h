@@ -8,17 +8,18 @@
 #include "Object.h"
 #include "Plane.h"
 
-class Cone : public Object {
+class Cone : public TransformedObject {
  private:
   Plane *plane;
  public:
-  explicit Cone(Material material) {
+  explicit Cone(MaterialId material) {
     this->material = material;
     plane = new Plane(glm::vec3(0, 1, 0), glm::vec3(0.0, 1, 0));
   }
 
-  Hit intersect(Ray ray) override {
+  Hit queryHit(Ray ray) override {
 
+    STAT_INC(PRIMITIVE_TESTS);
     Hit hit{};
     hit.hit = false;
 
@@ -49,24 +50,32 @@ class Cone : public Object {
       }
     }
 
-    hit.normal = glm::vec3(hit.intersection.x, -hit.intersection.y, hit.intersection.z);
-    hit.normal = glm::normalize(hit.normal);
-
+    hit.primitive = this;
     Ray new_ray(o, d);
-    Hit hit_plane = plane->intersect(new_ray);
+    Hit hit_plane = plane->queryHit(new_ray);
     if (hit_plane.hit && hit_plane.distance < t && length(hit_plane.intersection - glm::vec3(0, 1, 0)) <= 1.0) {
       hit.intersection = hit_plane.intersection;
-      hit.normal = hit_plane.normal;
+      hit.primitive = plane;
     }
 
     hit.hit = true;
     hit.object = this;
     hit.intersection = transformationMatrix * glm::vec4(hit.intersection, 1.0); //implicit cast to vec3
-    hit.normal = (normalMatrix * glm::vec4(hit.normal, 0.0)); //implicit cast to vec3
-    hit.normal = glm::normalize(hit.normal);
     hit.distance = glm::length(hit.intersection - ray.origin);
 
     return hit;
   }
+
+  /** The normal is found from the intersection point brought back to object space, or is the one of the cap*/
+  void computeSurface(const Ray &, Hit &hit) override {
+    if (hit.primitive == plane) {
+      hit.normal = glm::vec3(0.0, 1, 0);
+    } else {
+      glm::vec3 p = inverseTransformationMatrix * glm::vec4(hit.intersection, 1.0); //implicit cast to vec3
+      hit.normal = glm::normalize(glm::vec3(p.x, -p.y, p.z));
+    }
+    hit.normal = (normalMatrix * glm::vec4(hit.normal, 0.0)); //implicit cast to vec3
+    hit.normal = glm::normalize(hit.normal);
+  }
 };
 #endif //USI_RENDERING_COMPETITION_OBJECT_CONE_H_
@@ -0,0 +1,84 @@
+//
+// Created by Volodymyr Karpenko on 16.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION_OBJECT_INSTANCE_H_
+#define USI_RENDERING_COMPETITION_OBJECT_INSTANCE_H_
+#include "Object.h"
+#include "Mesh.h"
+
+/**
+ One placement of a shared mesh in the scene, with its own transformation and material.
+ The ray is brought to the object space of the mesh once and the hit is brought back to world space.
+ */
+class Instance : public TransformedObject {
+ protected:
+  Mesh *mesh; ///< Shared geometry, owned by the mesh cache
+ public:
+  /**
+   @param mesh Mesh to place in the scene
+   @param material Material used for every triangle of this instance
+   */
+  Instance(Mesh *mesh, MaterialId material) : mesh(mesh) {
+    this->material = material;
+  }
+
+  Hit queryHit(Ray ray) override {
+    glm::vec3 d = inverseTransformationMatrix * glm::vec4(ray.direction, 0.0); //implicit cast to vec3
+    glm::vec3 o = inverseTransformationMatrix * glm::vec4(ray.origin, 1.0); //implicit cast to vec3
+    d = glm::normalize(d);
+
+    Hit hit = mesh->queryHit(Ray(o, d));
+    if (!hit.hit)
+      return hit;
+
+    hit.object = this;
+    hit.intersection = transformationMatrix * glm::vec4(hit.intersection, 1.0); //implicit cast to vec3
+    hit.distance = glm::length(hit.intersection - ray.origin);
+    return hit;
+  }
+
+  /** Bounds of the instance in world space, around the transformed bounds of the mesh*/
+  AABB bounds() const {
+    AABB local = mesh->bounds(), box;
+    for (int corner = 0; corner < 8; corner++) {
+      glm::vec3 p(corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y,
+                  corner & 4 ? local.max.z : local.min.z);
+      box.grow(glm::vec3(transformationMatrix * glm::vec4(p, 1.0)));
+    }
+    return box;
+  }
+
+  /** The triangle gives its normal in object space, brought to world space here*/
+  void computeSurface(const Ray &ray, Hit &hit) override {
+    mesh->computeSurface(ray, hit);
+    hit.normal = (normalMatrix * glm::vec4(hit.normal, 0.0)); //implicit cast to vec3
+    hit.normal = glm::normalize(hit.normal);
+  }
+
+  void queryHits(const RayPacket &packet, Hit *closest) override {
+    RayPacket local;
+    local.size = packet.size;
+    Hit hits[RayPacket::MAX];
+    for (int i = 0; i < packet.size; i++) {
+      Ray ray = packet.ray(i);
+      glm::vec3 d = inverseTransformationMatrix * glm::vec4(ray.direction, 0.0); //implicit cast to vec3
+      glm::vec3 o = inverseTransformationMatrix * glm::vec4(ray.origin, 1.0); //implicit cast to vec3
+      local.set(i, Ray(o, glm::normalize(d)));
+      hits[i].hit = false;
+      hits[i].distance = INFINITY;
+    }
+    mesh->queryHits(local, hits);
+    for (int i = 0; i < packet.size; i++) {
+      if (!hits[i].hit)
+        continue;
+      Hit hit = hits[i];
+      hit.object = this;
+      hit.intersection = transformationMatrix * glm::vec4(hit.intersection, 1.0); //implicit cast to vec3
+      hit.distance = glm::length(hit.intersection - packet.ray(i).origin);
+      if (hit.distance < closest[i].distance)
+        closest[i] = hit;
+    }
+  }
+};
+#endif //USI_RENDERING_COMPETITION_OBJECT_INSTANCE_H_
@@ -0,0 +1,481 @@
+//
+// Created by Volodymyr Karpenko on 16.12.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION_OBJECT_MESH_H_
+#define USI_RENDERING_COMPETITION_OBJECT_MESH_H_
+#include "Object.h"
+#include "Triangle.h"
+#include "BVH.h"
+#include "PerlinNoise.h"
+#include "../Trace.h"
+#include "../Perf.h"
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+
+using namespace std;
+
+typedef vector<float> point;
+
+class Node {
+ public:
+  int split_plane;
+  Triangle *p;
+  Node *left;
+  Node *right;
+
+  Node(int split_plane, Triangle *p, Node *left, Node *right)
+      : split_plane(split_plane), p(p), left(left), right(right) {
+  }
+  ~Node() {
+    delete left;
+    delete right;
+  }
+};
+
+/**
+ Hierarchy built over the triangles of a mesh
+ */
+enum class MeshLayout {
+  Tree, ///< One heap allocated node per triangle
+  Bvh, ///< Binary BVH in a flat array, small leaves of triangles
+  Compact ///< 4-wide BVH with quantized child bounds, one cache line per node
+};
+
+/**
+ Bottom-level geometry of an OBJ file: the triangles and the tree built over them, in object space.
+ A mesh carries no transformation and no material of its own, those belong to the Instance placing it in the scene,
+ so one loaded mesh can be shared by any number of instances.
+ */
+class Mesh {
+ private:
+  MeshLayout layout;
+  vector<Triangle *> triangles;
+  Node *tree = nullptr;
+  BVHBuilder bvh;
+  vector<Triangle *> parse_to_triangles(const vector<point> &points, bool displace) {
+    PerlinNoise np;
+    vector<Triangle *> triangles;
+    for (int i = 0; i < points.size(); i += 3) {
+      point v1 = points[i];
+      point v2 = points[i + 1];
+      point v3 = points[i + 2];
+      if (displace) {
+        v1[1] += (float) np.noise(v1[0], v1[1], v1[2]);
+        v2[1] += (float) np.noise(v2[0], v2[1], v2[2]);
+        v3[1] += (float) np.noise(v3[0], v3[1], v3[2]);
+      }
+      triangles.push_back(new Triangle(v1, v2, v3));
+    }
+    return triangles;
+  }
+  static int extract_index(string x) {
+    replace(x.begin(), x.end(), '/', ' ');
+    std::stringstream ss(x);
+    int p;
+    ss >> p;
+    return p - 1;
+  }
+  Node *node_tree(vector<Triangle *> points, int begin, int end, int depth = 0) {
+    if (end <= begin)
+      return nullptr;
+    unsigned int k = 3;
+    unsigned int axis = depth % k;
+    sort(&points[begin], &points[end], [axis](const Triangle *a, const Triangle *b) -> bool {
+      if (axis == 0) {
+        return a->v1.x < b->v1.x && a->v2.x < b->v2.x && a->v3.x < b->v3.x;
+      } else if (axis == 1) {
+        return a->v1.y < b->v1.y && a->v2.y < b->v2.y && a->v3.y < b->v3.y;
+      } else {
+        return a->v1.z < b->v1.z && a->v2.z < b->v2.z && a->v3.z < b->v3.z;
+      }
+    });
+    int median = begin + (end - begin) / 2;
+    return new Node(
+        median,
+        points[median],
+        node_tree(points, begin, median, depth + 1),
+        node_tree(points, median + 1, end, depth + 1));
+  }
+
+  void kdtree(const vector<Triangle *> &triangles) {
+    tree = node_tree(triangles, 0, (int) triangles.size());
+  }
+
+  void build_bvh(BVHSettings settings) {
+    vector<glm::vec3> vertices;
+    vertices.reserve(3 * triangles.size());
+    for (auto &triangle: triangles) {
+      vertices.push_back(triangle->v1);
+      vertices.push_back(triangle->v2);
+      vertices.push_back(triangle->v3);
+    }
+    bvh.build(vertices, settings);
+    if (layout == MeshLayout::Compact)
+      bvh.compact();
+  }
+
+  /** Tests a ray against a run of triangles referenced by a leaf, keeping the closest hit*/
+  void intersect_leaf(const Ray &ray, int first, int count, Hit &closest) {
+    for (int i = first; i < first + count; i++) {
+      Hit hit = triangles[bvh.indices[i]]->queryHit(ray);
+      if (hit.hit && hit.distance < closest.distance)
+        closest = hit;
+    }
+  }
+
+  Hit intersect_bvh(const Ray &ray) {
+    Hit closest{};
+    closest.hit = false;
+    closest.distance = INFINITY;
+    glm::vec3 inv_direction = 1.0f / ray.direction;
+
+    pair<int, float> stack[128];
+    int size = 0;
+    float t_near;
+    if (bvh.nodes[0].bounds.intersect(ray.origin, inv_direction, INFINITY, t_near))
+      stack[size++] = make_pair(0, t_near);
+    while (size > 0) {
+      pair<int, float> entry = stack[--size];
+      if (entry.second > closest.distance)
+        continue;
+      STAT_INC(NODE_VISITS);
+      const BVHNode &node = bvh.nodes[entry.first];
+      if (node.leaf()) {
+        intersect_leaf(ray, node.first, node.count, closest);
+        continue;
+      }
+      float t_left, t_right;
+      bool left = bvh.nodes[node.first].bounds.intersect(ray.origin, inv_direction, closest.distance, t_left);
+      bool right = bvh.nodes[node.first + 1].bounds.intersect(ray.origin, inv_direction, closest.distance, t_right);
+      // the nearer child is pushed last so that it is visited first
+      if (left && right && t_left < t_right) {
+        stack[size++] = make_pair(node.first + 1, t_right);
+        stack[size++] = make_pair(node.first, t_left);
+      } else {
+        if (left)
+          stack[size++] = make_pair(node.first, t_left);
+        if (right)
+          stack[size++] = make_pair(node.first + 1, t_right);
+      }
+    }
+    return closest;
+  }
+
+  Hit intersect_compact(const Ray &ray) {
+    Hit closest{};
+    closest.hit = false;
+    closest.distance = INFINITY;
+    glm::vec3 inv_direction = 1.0f / ray.direction;
+
+    pair<int, float> stack[256];
+    int size = 0;
+    stack[size++] = make_pair(0, 0.f);
+    while (size > 0) {
+      pair<int, float> entry = stack[--size];
+      if (entry.second > closest.distance)
+        continue;
+      STAT_INC(NODE_VISITS);
+      const CompactNode &node = bvh.compact_nodes[entry.first];
+      pair<int, float> inner[4];
+      int inner_count = 0;
+      for (int i = 0; i < node.child_count; i++) {
+        float t;
+        if (!node.child_bounds(i).intersect(ray.origin, inv_direction, closest.distance, t))
+          continue;
+        if (node.triangle_count[i] > 0) {
+          intersect_leaf(ray, (int) node.child[i], node.triangle_count[i], closest);
+        } else {
+          inner[inner_count++] = make_pair((int) node.child[i], t);
+        }
+      }
+      // farthest children go to the stack first
+      for (int i = 1; i < inner_count; i++) {
+        for (int j = i; j > 0 && inner[j].second > inner[j - 1].second; j--)
+          swap(inner[j], inner[j - 1]);
+      }
+      for (int i = 0; i < inner_count; i++)
+        stack[size++] = inner[i];
+    }
+    return closest;
+  }
+  /** Order in which the two children of a node are visited by a packet, following its first active ray*/
+  bool left_first(const RayPacket &packet, uint32_t mask, const AABB &left, const AABB &right) const {
+    int i = __builtin_ctz(mask);
+    glm::vec3 d(packet.direction[0][i], packet.direction[1][i], packet.direction[2][i]);
+    return glm::dot(left.center() - right.center(), d) <= 0;
+  }
+
+  /** Tests the active rays of a packet against the triangles of a leaf, one ray at a time*/
+  void intersect_leaf(const RayPacket &packet, uint32_t mask, int first, int count, Hit *closest, float *t_max) {
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      intersect_leaf(packet.ray(i), first, count, closest[i]);
+      t_max[i] = closest[i].distance;
+    }
+  }
+
+  void intersect_bvh(const RayPacket &packet, Hit *closest) {
+    float t_max[RayPacket::MAX];
+    for (int i = 0; i < packet.size; i++)
+      t_max[i] = closest[i].distance;
+
+    pair<int, uint32_t> stack[128];
+    int size = 0;
+    stack[size++] = make_pair(0, packet.all());
+    while (size > 0) {
+      pair<int, uint32_t> entry = stack[--size];
+      STAT_INC(NODE_VISITS);
+      const BVHNode &node = bvh.nodes[entry.first];
+      uint32_t mask = node.bounds.intersect(packet, t_max, entry.second);
+      if (mask == 0)
+        continue;
+      if (node.leaf()) {
+        intersect_leaf(packet, mask, node.first, node.count, closest, t_max);
+        continue;
+      }
+      // the child visited first is pushed last, both are tested when popped
+      if (left_first(packet, mask, bvh.nodes[node.first].bounds, bvh.nodes[node.first + 1].bounds)) {
+        stack[size++] = make_pair(node.first + 1, mask);
+        stack[size++] = make_pair(node.first, mask);
+      } else {
+        stack[size++] = make_pair(node.first, mask);
+        stack[size++] = make_pair(node.first + 1, mask);
+      }
+    }
+  }
+
+  void intersect_compact(const RayPacket &packet, Hit *closest) {
+    float t_max[RayPacket::MAX];
+    for (int i = 0; i < packet.size; i++)
+      t_max[i] = closest[i].distance;
+
+    pair<int, uint32_t> stack[256];
+    int size = 0;
+    stack[size++] = make_pair(0, packet.all());
+    while (size > 0) {
+      pair<int, uint32_t> entry = stack[--size];
+      STAT_INC(NODE_VISITS);
+      const CompactNode &node = bvh.compact_nodes[entry.first];
+      pair<int, uint32_t> inner[4];
+      float order[4];
+      int inner_count = 0;
+      int first_ray = __builtin_ctz(entry.second);
+      glm::vec3 d(packet.direction[0][first_ray], packet.direction[1][first_ray], packet.direction[2][first_ray]);
+      for (int i = 0; i < node.child_count; i++) {
+        AABB box = node.child_bounds(i);
+        uint32_t mask = box.intersect(packet, t_max, entry.second);
+        if (mask == 0)
+          continue;
+        if (node.triangle_count[i] > 0) {
+          intersect_leaf(packet, mask, (int) node.child[i], node.triangle_count[i], closest, t_max);
+        } else {
+          order[inner_count] = glm::dot(box.center(), d);
+          inner[inner_count++] = make_pair((int) node.child[i], mask);
+        }
+      }
+      // farthest children along the first ray go to the stack first
+      for (int i = 1; i < inner_count; i++) {
+        for (int j = i; j > 0 && order[j] > order[j - 1]; j--) {
+          swap(order[j], order[j - 1]);
+          swap(inner[j], inner[j - 1]);
+        }
+      }
+      for (int i = 0; i < inner_count; i++)
+        stack[size++] = inner[i];
+    }
+  }
+ public:
+  int triangle_count = 0; ///< Number of triangles owned by the mesh
+
+  /** Bounds of the triangles in object space*/
+  AABB bounds() const {
+    AABB box;
+    for (auto &triangle: triangles) {
+      box.grow(triangle->v1);
+      box.grow(triangle->v2);
+      box.grow(triangle->v3);
+    }
+    return box;
+  }
+
+  /** Number of triangle references in the leaves, larger than the triangle count when spatial splits duplicated some*/
+  int reference_count() const {
+    return layout == MeshLayout::Tree ? triangle_count : (int) bvh.indices.size();
+  }
+
+  /**
+   Loads an OBJ file and builds the tree over its triangles
+   @param name Path to the OBJ file
+   @param displace Whether the vertices should be displaced vertically with Perlin noise
+   @param layout Hierarchy to build over the triangles
+   @param settings How the BVH layouts are built, e.g. with spatial splits
+   */
+  Mesh(const string &name, bool displace, MeshLayout layout = MeshLayout::Tree, BVHSettings settings = BVHSettings())
+      : layout(layout) {
+    ifstream myfile;
+    myfile.open(name);
+    char v;
+    float x, y, z;
+    string f1, f2, f3, f4;
+    vector<point> points;
+    vector<vector<int>> faces;
+    vector<point> ret_points;
+    string str;
+    STAT_TIMER(load_timer, LOAD_PHASE);
+    TraceScope parse_trace("OBJ parse", "phase");
+    PerfScope load_perf(LOAD_PHASE);
+    if (myfile.is_open()) {
+      while (getline(myfile, str)) {
+        std::stringstream ss(str);
+        ss >> v;
+        if (v == 'v') {
+          ss >> x >> y >> z;
+          points.push_back({x, y, z});
+        }
+        if (v == 'f') {
+          ss >> f1 >> f2 >> f3;
+          ret_points.push_back(points[extract_index(f1)]);
+          ret_points.push_back(points[extract_index(f2)]);
+          ret_points.push_back(points[extract_index(f3)]);
+        }
+      }
+      myfile.close();
+    }
+    triangles = parse_to_triangles(ret_points, displace);
+    STAT_TIMER_STOP(load_timer);
+    parse_trace.stop();
+    load_perf.stop();
+    triangle_count = (int) triangles.size();
+    if (triangles.empty())
+      return;
+    STAT_TIMER(build_timer, BUILD_PHASE);
+    TraceScope build_trace("tree build", "phase");
+    PerfScope build_perf(BUILD_PHASE);
+    if (layout == MeshLayout::Tree) {
+      kdtree(triangles);
+    } else {
+      build_bvh(settings);
+    }
+  }
+  ~Mesh() {
+    delete tree;
+    for (auto &triangle: triangles)
+      delete triangle;
+  }
+
+  /** Finds the closest triangle hit by a ray given in object space of the mesh, see Object::queryHit*/
+  Hit queryHit(Ray ray) {
+    if (layout == MeshLayout::Bvh && !bvh.nodes.empty())
+      return intersect_bvh(ray);
+    if (layout == MeshLayout::Compact && !bvh.compact_nodes.empty())
+      return intersect_compact(ray);
+    return intersect_local(ray, tree, 0);
+  }
+
+  /**
+   Finds the closest triangles hit by a packet of rays given in object space of the mesh,
+   the BVH layouts share the traversal among the rays
+   @param packet Rays to intersect
+   @param closest Closest hit found so far for every ray, replaced where the mesh is closer
+   */
+  void queryHits(const RayPacket &packet, Hit *closest) {
+    if (layout == MeshLayout::Bvh && !bvh.nodes.empty()) {
+      intersect_bvh(packet, closest);
+    } else if (layout == MeshLayout::Compact && !bvh.compact_nodes.empty()) {
+      intersect_compact(packet, closest);
+    } else {
+      for (int i = 0; i < packet.size; i++) {
+        Hit hit = queryHit(packet.ray(i));
+        if (hit.hit && hit.distance < closest[i].distance)
+          closest[i] = hit;
+      }
+    }
+  }
+
+  /** Completes the hit of a triangle of the mesh, in object space*/
+  void computeSurface(const Ray &ray, Hit &hit) {
+    hit.primitive->computeSurface(ray, hit);
+  }
+
+  Hit intersect_local(Ray ray, Node *node, int depth) {
+    unsigned int k = 3;
+    unsigned int axis = depth % k;
+    if (node == nullptr) {
+      Hit hit{};
+      hit.hit = false;
+      return hit;
+    }
+    STAT_INC(NODE_VISITS);
+    Hit hit = node->p->queryHit(ray);
+    if (hit.hit)
+      return hit;
+    if (axis == 0) {
+      if (ray.direction.x <= node->split_plane) {
+        hit = intersect_local(ray, node->left, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->right, depth + 1);
+        }
+      } else {
+        hit = intersect_local(ray, node->right, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->left, depth + 1);
+        }
+      }
+    } else if (axis == 1) {
+      if (ray.direction.y <= node->split_plane) {
+        hit = intersect_local(ray, node->left, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->right, depth + 1);
+        }
+      } else {
+        hit = intersect_local(ray, node->right, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->left, depth + 1);
+        }
+      }
+    } else {
+      if (ray.direction.z <= node->split_plane) {
+        hit = intersect_local(ray, node->left, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->right, depth + 1);
+        }
+      } else {
+        hit = intersect_local(ray, node->right, depth + 1);
+        if (!hit.hit) {
+          hit = intersect_local(ray, node->left, depth + 1);
+        }
+      }
+    }
+    return hit;
+  }
+};
+
+map<tuple<string, bool, MeshLayout, bool, float>, Mesh *> meshes; ///< Meshes loaded so far, keyed by file and build parameters
+
+/**
+ Returns the mesh stored in an OBJ file, parsing the file and building its tree only on the first request
+ @param name Path to the OBJ file
+ @param displace Whether the vertices should be displaced vertically with Perlin noise
+ @param layout Hierarchy to build over the triangles
+ @param settings How the BVH layouts are built, e.g. with spatial splits
+ @return A mesh shared by all the callers asking for the same file
+ */
+Mesh *load_mesh(const string &name, bool displace, MeshLayout layout = MeshLayout::Tree,
+                BVHSettings settings = BVHSettings()) {
+  Mesh *&mesh = meshes[make_tuple(name, displace, layout, settings.spatial_splits, settings.max_growth)];
+  if (mesh == nullptr) {
+    mesh = new Mesh(name, displace, layout, settings);
+  }
+  return mesh;
+}
+
+#endif //USI_RENDERING_COMPETITION_OBJECT_MESH_H_
@@ -9,6 +9,7 @@
 #include "../glm/gtx/transform.hpp"
 #include "../Material.h"
 #include "../Ray.h"
+#include "../Stats.h"
 
 class Object;
 
@@ -19,24 +20,78 @@ struct Hit {
   float distance; ///< Distance from the origin of the ray to the intersection point
   Object *object; ///< A pointer to the intersected object
   glm::vec2 uv; ///< Coordinates for computing the texture (texture coordinates)
+  Object *primitive; ///< The primitive intersected inside the object, e.g. the triangle of a mesh instance
+  glm::vec2 barycentric; ///< Barycentric coordinates of the intersection point on a triangle
 };
 
 class Object {
- protected:
-  glm::mat4 transformationMatrix;
-  glm::mat4 inverseTransformationMatrix;
-  glm::mat4 normalMatrix;
  public:
   glm::vec3 color;
-  Material material;
-  virtual Hit intersect(Ray ray) = 0;
+  MaterialId material = 0; ///< Index of the material in the material table
+  int id = -1; ///< Index of the object in the scene, set once the scene is built
+
+  virtual ~Object() = default;
+
+  /**
+   Cheap intersection test run for every candidate object: it finds the intersection point, the distance,
+   the object and primitive hit and the barycentric coordinates, but leaves the normal and uv to computeSurface
+   @param ray Ray to intersect
+   */
+  virtual Hit queryHit(Ray ray) = 0;
+
+  /**
+   Completes a hit found by queryHit with the normal and texture coordinates, only run for the closest hit
+   @param ray Ray that was intersected
+   @param hit Hit returned by queryHit for the ray
+   */
+  virtual void computeSurface(const Ray &, Hit &) {
+  }
+
+  /** Texture coordinates covered by a unit of length on the surface, converting widths on it into uv units*/
+  virtual float uvScale() const {
+    return 1.0f;
+  }
 
-  void setMaterial(Material material){
+  /** Intersection with every attribute of the surface*/
+  Hit intersect(Ray ray) {
+    Hit hit = queryHit(ray);
+    if (hit.hit)
+      computeSurface(ray, hit);
+    return hit;
+  }
+
+  /**
+   Runs queryHit for all the rays of a packet, by default one ray after the other
+   @param packet Rays to intersect
+   @param closest Closest hit found so far for every ray, replaced where this object is closer
+   */
+  virtual void queryHits(const RayPacket &packet, Hit *closest) {
+    for (int i = 0; i < packet.size; i++) {
+      Hit hit = queryHit(packet.ray(i));
+      if (hit.hit && hit.distance < closest[i].distance)
+        closest[i] = hit;
+    }
+  }
+
+  void setMaterial(MaterialId material){
     this->material = material;
   }
-  Material getMaterial() const{
-    return material;
+  const Material &getMaterial() const{
+    return materials[material];
   };
+};
+
+/**
+ Object defined in its own space and placed in the scene by a transformation, the rays being brought to its space.
+ Objects intersected in the space the ray is given in, as spheres, planes and the triangles inside a mesh, derive from
+ Object directly and carry no matrices
+ */
+class TransformedObject : public Object {
+ protected:
+  glm::mat4 transformationMatrix = glm::mat4(1.0f);
+  glm::mat4 inverseTransformationMatrix = glm::mat4(1.0f);
+  glm::mat4 normalMatrix = glm::mat4(1.0f);
+ public:
   void setTransformation(glm::mat4 matrix){
     transformationMatrix = matrix;
     inverseTransformationMatrix = glm::inverse(matrix);
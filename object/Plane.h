@@ -11,17 +11,30 @@ class Plane : public Object {
  private:
   glm::vec3 normal;
   glm::vec3 point;
+  glm::vec3 el1; ///< First axis of the texture coordinates in the plane
+  glm::vec3 el2; ///< Second axis of the texture coordinates in the plane
+
+  void texture_axes() {
+    el1 = glm::normalize(glm::cross(normal, glm::vec3(1.f, 0.f, 0.f)));
+    if (el1 == glm::vec3(0)){
+      el1 = glm::normalize(glm::cross(normal, glm::vec3(0.f, 0.f, 1.f)));
+    }
+    el2 = glm::normalize(glm::cross(normal, el1));
+  }
 
  public:
   Plane(glm::vec3 point, glm::vec3 normal) : point(point), normal(normal) {
+    texture_axes();
   }
 
-  Plane(glm::vec3 point, glm::vec3 normal, Material material) : point(point), normal(normal) {
+  Plane(glm::vec3 point, glm::vec3 normal, MaterialId material) : point(point), normal(normal) {
     this->material = material;
+    texture_axes();
   }
 
-  Hit intersect(Ray ray) override {
+  Hit queryHit(Ray ray) override {
 
+    STAT_INC(PRIMITIVE_TESTS);
     Hit hit{};
     hit.hit = false;
     float DdotN = glm::dot(ray.direction, normal);
@@ -32,20 +45,19 @@ class Plane : public Object {
 
       if (t > 0) {
         hit.hit = true;
-        hit.normal = normal;
         hit.distance = t;
         hit.object = this;
+        hit.primitive = this;
         hit.intersection = t * ray.direction + ray.origin;
-        glm::vec3 el1 = glm::normalize(glm::cross(normal, glm::vec3(1.f, 0.f, 0.f)));
-        if (el1 == glm::vec3(0)){
-          el1 = glm::normalize(glm::cross(normal, glm::vec3(0.f, 0.f, 1.f)));
-        }
-        glm::vec3 el2 = glm::normalize(glm::cross(normal, el1));
-        hit.uv.s = glm::dot(el1,hit.intersection);
-        hit.uv.t = glm::dot(el2,hit.intersection);
       }
     }
     return hit;
   }
+
+  void computeSurface(const Ray &, Hit &hit) override {
+    hit.normal = normal;
+    hit.uv.s = glm::dot(el1,hit.intersection);
+    hit.uv.t = glm::dot(el2,hit.intersection);
+  }
 };
 #endif //USI_RENDERING_COMPETITION_OBJECT_PLANE_H_
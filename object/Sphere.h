@@ -23,13 +23,19 @@ class Sphere : public Object {
     this->color = color;
   }
 
-  Sphere(float radius, glm::vec3 center, Material material) : radius(radius), center(center) {
+  Sphere(float radius, glm::vec3 center, MaterialId material) : radius(radius), center(center) {
     this->material = material;
   }
 
+  /** The uv square is wrapped around the whole sphere, s running over half a great circle*/
+  float uvScale() const override {
+    return (float) (1.0 / (M_PI * radius));
+  }
+
   /** Implementation of the intersection function*/
-  Hit intersect(Ray ray) override {
+  Hit queryHit(Ray ray) override {
 
+    STAT_INC(PRIMITIVE_TESTS);
     glm::vec3 c = center - ray.origin;
 
     float cdotc = glm::dot(c, c);
@@ -54,17 +60,20 @@ class Sphere : public Object {
       }
 
       hit.intersection = ray.origin + t * ray.direction;
-      hit.normal = glm::normalize(hit.intersection - center);
       hit.distance = glm::distance(ray.origin, hit.intersection);
       hit.object = this;
-
-      hit.uv.s = (float) ((asin(hit.normal.y) + M_PI / 2) / M_PI);
-      hit.uv.t = (float)((atan2(hit.normal.z, hit.normal.x) + M_PI) / (2 * M_PI));
+      hit.primitive = this;
     } else {
       hit.hit = false;
     }
     return hit;
   }
+
+  void computeSurface(const Ray &, Hit &hit) override {
+    hit.normal = glm::normalize(hit.intersection - center);
+    hit.uv.s = (float) ((asin(hit.normal.y) + M_PI / 2) / M_PI);
+    hit.uv.t = (float)((atan2(hit.normal.z, hit.normal.x) + M_PI) / (2 * M_PI));
+  }
 };
 
 #endif //USI_RENDERING_COMPETITION_OBJECT_SPHERE_H_
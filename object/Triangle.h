@@ -1,8 +1,19 @@
+//
+// Created by Volodymyr Karpenko on 12.11.21.
+//
+
+#ifndef USI_RENDERING_COMPETITION_OBJECT_TRIANGLE_H_
+#define USI_RENDERING_COMPETITION_OBJECT_TRIANGLE_H_
+
 #include "Object.h"
 
-class Triangle : public Object {
+/**
+ Triangle given in the space it is intersected in, world space for the scene or object space inside a mesh,
+ so the ray is used as it is. Final so that the mesh traversal calls queryHit without a virtual call
+ */
+class Triangle final : public Object {
  protected:
-  const float EPSILON = 0.0000001;
+  static constexpr float EPSILON = 0.0000001f;
  public:
   glm::vec3 v1{};
   glm::vec3 v2{};
@@ -27,13 +38,13 @@ class Triangle : public Object {
   }
 
   //compute ray plane intersection to find P
-  Hit intersect(Ray ray) override {
+  Hit queryHit(Ray ray) override {
+    STAT_INC(PRIMITIVE_TESTS);
     Hit hit{};
     hit.hit = false;
 
-    glm::vec3 d = inverseTransformationMatrix * glm::vec4(ray.direction, 0.0);
-    d = glm::normalize(d);
-    glm::vec3 o = inverseTransformationMatrix * glm::vec4(ray.origin, 1.0);
+    glm::vec3 d = ray.direction;
+    glm::vec3 o = ray.origin;
 
     // Calculate determinant
     glm::vec3 p = glm::cross(d, e2);
@@ -65,10 +76,11 @@ class Triangle : public Object {
 
     if ((glm::dot(e2, q) * invDet) > EPSILON) {
       //ray does intersect
-      hit.intersection = transformationMatrix * glm::vec4(v1 + u*e1 + v*e2,1.0);
-      hit.normal = normal;
+      hit.intersection = v1 + u*e1 + v*e2;
+      hit.barycentric = glm::vec2(u, v);
       hit.distance = glm::dot(e2, q) * invDet;
       hit.object = this;
+      hit.primitive = this;
       hit.hit = true;
       return hit;
     }
@@ -76,4 +88,9 @@ class Triangle : public Object {
     // No hit at all
     return hit;
   }
-};
\ No newline at end of file
+
+  void computeSurface(const Ray &, Hit &hit) override {
+    hit.normal = normal;
+  }
+};
+#endif //USI_RENDERING_COMPETITION_OBJECT_TRIANGLE_H_
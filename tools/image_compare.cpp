@@ -0,0 +1,34 @@
+//
+// Created by Volodymyr Karpenko on 11.01.22.
+//
+
+#include <iostream>
+#include "Image.h"
+#include "ImageCompare.h"
+#include "Options.h"
+
+using namespace std;
+
+/**
+ Compares a rendered image with a reference image, e.g. a golden image rendered with --deterministic, and fails
+ when it differs by more than the thresholds.
+ Usage: image_compare image.ppm reference.ppm [--max-rmse=e] [--min-psnr=dB] [--max-flip=e] [--error-map=path]
+ @return 0 when the image passes, 1 when it does not and 2 when an image cannot be read
+ */
+int main(int argc, const char *argv[]) {
+  Options options = parse_options(argc, argv);
+  if (options.positional.size() != 2) {
+    cerr << "Usage: image_compare image.ppm reference.ppm [--max-rmse=e] [--min-psnr=dB] [--max-flip=e]"
+            " [--error-map=path]" << endl;
+    return 2;
+  }
+  Image *images[2];
+  for (int m = 0; m < 2; m++) {
+    images[m] = Image::readImage(options.positional[m].c_str());
+    if (!images[m]) {
+      cerr << "Cannot read the image " << options.positional[m] << endl;
+      return 2;
+    }
+  }
+  return check_image(*images[0], *images[1], options) ? 0 : 1;
+}